@@ -38,47 +38,630 @@
   Signed by: Zhuyirui Xu
   Dated:     17 October 2025
 */
+// Build as C11 (-std=c11, clean under -pedantic) for _Atomic, _Thread_local
+// and _Alignas. Strict ISO modes hide POSIX declarations (fileno, mkstemp,
+// clock_gettime), so they are asked for here.
+#if !defined(__STDC_VERSION__) || __STDC_VERSION__ < 201112L
+#error "build with -std=c11 or later"
+#endif
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <dirent.h>
+#define HAVE_MMAP 1
+#define HAVE_THREADS 1
+#define HAVE_DIRENT 1
+#else
+// Without threads the search runs on the calling thread alone
+typedef int pthread_mutex_t;
+#define pthread_mutex_init(m, a) ((void)(m))
+#define pthread_mutex_destroy(m) ((void)(m))
+#define pthread_mutex_lock(m) ((void)(m))
+#define pthread_mutex_unlock(m) ((void)(m))
+#endif
 
 /* #DEFINE'S -----------------------------------------------------------------*/
 #define SDELIM "==STAGE %d============================\n"   // stage delimiter
 #define THEEND "==THE END============================\n"    // end message
 #define MTXDIM "%dx%d\n"                // matrix dimensions input format
-#define MAX_LINE_LEN 1000
+#define MAX_LINE_LEN 1000               // longest line read at once, as fgets
+                                        // with a buffer of this size would
+#define INPUT_BLOCK_SIZE (1 << 20)      // bytes read from a pipe at a time
+#define MAX_OP_ARGS 4
+#define SCRATCH_ALIGN 16                // alignment of scratch buffers
+#define ALLOC_STATS_ENV "MATRIX_ALLOC_STATS" // report allocation counts
+#define COLUMN_INDEX_ENV "MATRIX_COLUMN_INDEX" // column index mode
+#define SIMD_ENV "MATRIX_SIMD"          // force a kernel code path
+#define THREADS_ENV "MATRIX_THREADS"    // threads used by large operations
+#define SPILL_ENV "MATRIX_SPILL"        // directory for spilled matrices
 #define INITIAL_CAPACITY 0
 #define GROWTH_FACTOR 2
 #define MAX_SMALL_DIM 35
 #define MAX_SMALL_VAL 9
+#define HYPERSPARSE_RATIO 16            // use DCSR while at most 1 in 16 rows
+                                        // holds a non-zero value
+#define COUNT_SORT_RATIO 8              // bulk builds count columns while
+                                        // there are at most 8 per triplet
+#define GAPPED_MIN_SHIFT 4096           // switch to gapped rows rather than
+                                        // shift more entries than this
+#define GAP_MIN_SLACK 2                 // spare entries given to every row
+#define VAL_CHUNK 256                   // narrow values widened at a time
 #define DELIMITER "-------------------------------------"
+#define OUTPUT_ENV "MATRIX_OUTPUT"      // environment variable for output mode
+#define OUTPUT_BUF_SIZE (1 << 20)       // bytes buffered before each write
+#define FUSE_WINDOW 64                  // instructions read ahead in summary
+#define FUSE_PROBES 4                   // cells compared before a full check
+#define SEARCH_DELIM "==SEARCH=============================\n" // search header
+#define SEARCH_DEPTH 6                  // default longest sequence searched
+#define SEARCH_MEMORY_MB 256            // default memory budget of a search
+#define SEARCH_MAX_CELLS 4096           // largest matrix searched, in cells
+#define SEARCH_STRIPES 64               // visited set stripes, a power of 2
+#define SEARCH_STRIPE_SLOTS 64          // initial slots of each stripe
+#define SEARCH_CHUNK 16                 // states claimed by a worker at once
+#define MAX_THREADS 64                  // most worker threads started
+#define PAR_MIN_NNZ (1 << 18)           // entries before work is split up
+#define PAR_SPLIT 4                     // chunks per thread, for balance
+#define PAR_MAX_CHUNKS (PAR_SPLIT * MAX_THREADS) // most chunks in one job
+#define PAR_PRINT_CHUNK 16384           // entries formatted per chunk
+#define MEM_BUF_SIZE 4096               // initial size of in-memory output
+#define BATCH_DELIM "==FILE %s\n"       // header of each batch input's output
+#define BATCH_OUT_EXT ".out"            // suffix of per-input output files
+#define MAX_INT_CHARS 12                // longest int in decimal, with sign
+#define SNAP_PREFIX '@'                 // starts a matrix line naming a snapshot
+#define SNAP_MAGIC "CSRSNAP"            // first bytes of a snapshot file
+#define SNAP_VERSION 2                  // snapshot layout version
+#define SNAP_ALIGN 64                   // alignment of snapshot sections
+#define SPILL_NAME "/matrix-XXXXXX"     // spill file name, for mkstemp
+#define SPILL_BLOCKS 256                // row blocks a spilled matrix is
+                                        // built in
+#define SPILL_CHUNK 1024                // cells a row block writes at a time
+#define OPCODES "sSmarcRC"              // every opcode, in generator and
+                                        // profile order
+#define NUM_OPCODES 8                   // number of OPCODES
+#define PROFILE_ENV "MATRIX_PROFILE"    // profile report destination
+#define PROF_DEPTH 16                   // nested profiled routines tracked
+#define GEN_DEFAULTS "rows=1000,cols=1000,nnz=10000,skew=0,vals=9," \
+                     "instrs=1000,mix=s8S2m1a1r2c2R2C2,seed=1"
+#define BENCH_SCALES "rows=1000,cols=1000,nnz=10000;"                   \
+                     "rows=100000,cols=100000,nnz=100000;"              \
+                     "rows=1000000,cols=1000000,nnz=1000000;"           \
+                     "rows=1000000,cols=1000000,nnz=10000000,instrs=200"
+#define BENCH_HEADER "workload,rows,cols,nnz,phase,count,total_ms," \
+                     "ns_each,status\n"          // columns of bench results
+#define SNAP_SECTIONS 5                 // rptr, rid, vals, cidx and pord
+
+// Full structural check of the current matrix after every instruction,
+// compiled in only when built with -DCSR_DEBUG, as it costs O(nnz) a step
+#ifdef CSR_DEBUG
+#define CSR_CHECK(A) assert(csr_matrix_check(A))
+#else
+#define CSR_CHECK(A) ((void)0)
+#endif
+
+// Profiling hooks, compiled in only when built with -DPROFILE
+#ifdef PROFILE
+#define PROF_BEGIN(site) do { if (profile.on) prof_begin(site); } while (0)
+#define PROF_END(site) do { if (profile.on) prof_end(site); } while (0)
+#define PROF_SHIFT(n) do { if (profile.on) prof_shift(n); } while (0)
+#define PROF_REALLOC() do { if (profile.on) prof_realloc(); } while (0)
+#define PROF_PEAK(A) do { if (profile.on) prof_peak(A); } while (0)
+#ifdef HAVE_X86_SIMD
+#define PROF_UNIT "cycles"              // time stamp counter ticks
+#else
+#define PROF_UNIT "ns"
+#endif
+#else
+#define PROF_BEGIN(site) ((void)0)
+#define PROF_END(site) ((void)0)
+#define PROF_SHIFT(n) ((void)0)
+#define PROF_REALLOC() ((void)0)
+#define PROF_PEAK(A) ((void)0)
+#endif
 
 /* TYPE DEFINITIONS ----------------------------------------------------------*/
+// Column-major companion index: the physical rows holding a stored entry in
+// each physical column, in no particular order
+typedef struct {
+    int** rows;      // rows of each column, NULL while the column is empty
+    int* len;        // number of rows listed for each column
+    int* cap;        // capacity of each column's list
+    int* stamp;      // per-row marks used while editing a column
+    int  epoch;      // mark value of the current column edit
+} ColIndex_t;
+
 // Compressed Sparse Row (CSR) matrix representation
 typedef struct {
     int  rows;       // number of rows in this matrix
     int  cols;       // number of columns in this matrix
     int  nnz;        // number of stored non-zeros values in this matrix
     int  cap;        // matrix capacity to hold non-zero values
-    int* vals;       // non-zero values in this matrix
+    char* vals;      // non-zero values in this matrix, vbytes bytes each;
+                     // cidx and vals share one block, cap column indices
+                     // followed by cap values, which cidx points to
     int* cidx;       // column indices of non-zero values, in row-major order
-    int* rptr;       // row pointers
+    int  vbytes;     // width of each stored value: 1, 2 or 4 bytes, as an
+                     // int8_t, int16_t or int; widened on overflow
+    int* rptr;       // row pointers, one per stored row plus an end marker
+    int* rend;       // end of each slot's entries in gapped mode, where
+                     // slot k owns rptr[k] to rptr[k+1]-1 but only fills it
+                     // up to rend[k]-1; NULL when rows are packed
+    int* rid;        // ids of the stored rows in hypersparse (DCSR) mode,
+                     // NULL in CSR mode, where every row is stored
+    int* pord;       // rank of each stored entry in its row's input order,
+                     // so a matrix prints as it was read; NULL to print in
+                     // column order, and dropped by the first write
+    int  nrs;        // number of stored rows
+    int  rcap;       // capacity of rid and rptr
+    int* rperm;      // logical-to-physical row map, NULL if identity
+    int* rinv;       // physical-to-logical row map, NULL if identity
+    int* cperm;      // logical-to-physical column map, NULL if identity
+    int* cinv;       // physical-to-logical column map, NULL if identity
+    int  zeros;      // set if stored values may be zero (after a multiply)
+    int  scale;      // pending value transform v -> v*scale + offset
+    int  offset;     // (applied lazily to all stored values)
+    int  drop;       // set if the pending transform includes an add, so
+                     // values it maps to zero are removed when applied
+    int  vlo;        // bounds on the stored values, pending transform
+    int  vhi;        // included; loose after removals, vlo > vhi if unset.
+                     // They pick the narrowest vbytes holding all values
+    unsigned long long hash; // order-independent hash of non-zero cells
+    int  hashed;     // set if hash is up to date
+    ColIndex_t* csc; // column index, NULL until built or after an operation
+                     // that relabels or drops many entries at once
+    int  use_csc;    // set to build the column index for column instructions
+    char* snap;      // snapshot file holding rptr, rid, vals, cidx and pord,
+                     // which are then read-only; NULL if the arrays are owned
+    long snap_len;   // size of the snapshot file
 } CSRMatrix_t;
 
+// Header of a binary snapshot file, which holds one packed matrix with no
+// pending transform or permutation in native byte order. Sections follow
+// the header in the order rptr (nrs+1 ints), rid (nrs ints, in DCSR mode
+// only), vals and cidx (nnz ints each) and pord (nnz ints, if the matrix
+// keeps its input order), each at a multiple of SNAP_ALIGN.
+typedef struct {
+    char magic[8];   // SNAP_MAGIC
+    int  version;    // SNAP_VERSION
+    int  rows;       // matrix dimensions
+    int  cols;
+    int  nnz;        // number of stored values
+    int  nrs;        // number of stored rows
+    int  dcsr;       // set if rows are stored in DCSR mode
+    int  zeros;      // set if stored values may be zero
+    int  pord;       // set if entries keep their input-order ranks
+    unsigned long long hash; // matrix hash, as from csr_matrix_hash
+    unsigned long long checksum; // checksum of all sections
+    long long off[SNAP_SECTIONS]; // byte offset of each section
+} SnapHeader_t;
+
+// Allocation counters for the whole run
+typedef struct {
+    _Atomic long allocs;   // blocks obtained from malloc
+    _Atomic long reallocs; // blocks resized with realloc
+    _Atomic long frees;    // blocks returned with free
+    _Atomic long reuses;   // storage blocks served from the pool
+    _Atomic long scratch_peak; // largest scratch arena size, in bytes
+} AllocStats_t;
+
+// Per-thread memory pool: a spare storage block kept for reuse when a
+// matrix replaces or drops its storage, and a bump-allocated scratch arena
+// for temporary buffers. Scratch buffers live until scratch_release, and
+// the arena only grows while no buffers are in use.
+typedef struct {
+    char* spare;     // spare storage block, NULL if none
+    long spare_size; // size of the spare block, in bytes
+    char* scratch;   // scratch arena
+    long scratch_size; // size of the scratch arena
+    long scratch_used; // bytes in use in the scratch arena
+} MemPool_t;
+
+// Buffered writer; output is formatted into buf and flushed with one fwrite
+// whenever it fills up. Without a stream, buf grows to hold all output.
+typedef struct {
+    FILE* fp;        // destination stream, NULL to keep output in buf
+    char* buf;       // pending output
+    int  len;        // number of pending bytes
+    int  cap;        // buffer capacity
+} Writer_t;
+
+// Input buffer; either a read-only mapping of the whole input file, or a
+// block of a stream that is refilled as lines are consumed
+typedef struct {
+    FILE* fp;        // source stream
+    char* data;      // buffered input
+    long  len;       // number of valid bytes in data
+    long  pos;       // start of the next unread line
+    long  cap;       // size of data
+    int  eof;        // set once the stream has no more bytes
+    int  mapped;     // set if data is a memory mapping
+} Reader_t;
+
+// Instruction handler, indexed by opcode character
+typedef struct {
+    void (*run)(CSRMatrix_t*, int*); // apply instruction with parsed args
+    int  stage;      // stage the instruction belongs to, 0 if unknown
+    int  nargs;      // number of arguments taken
+} OpEntry_t;
+
+// Kernels over flat int arrays, one set per code path
+typedef struct {
+    const char* name; // code path: scalar, sse2 or avx2
+    int (*affine)(int*, int, int, int); // transform values in place
+    int (*compact)(int*, int*, int, int*, int*, int, int); // transform and
+                     // drop entries that become zero
+} Kernels_t;
+
+// Job for the thread pool: chunks 0 to nchunks-1, each run as fn(ctx, i)
+typedef struct {
+    void (*fn)(void*, int); // runs one chunk
+    void* ctx;       // shared job state
+    int  nchunks;    // number of chunks
+    _Atomic int next; // next unclaimed chunk
+} ParJob_t;
+
+#ifdef HAVE_THREADS
+// Thread pool for large matrix operations, running one job at a time
+typedef struct {
+    int  threads;    // threads per job, the calling thread included
+    pthread_mutex_t busy; // held while a job runs
+    pthread_mutex_t lock; // guards the fields below
+    pthread_cond_t wake; // signals a new job
+    pthread_cond_t idle; // signals the last worker leaving a job
+    ParJob_t* job;   // current job, NULL once its caller is done with it
+    long generation; // number of jobs started
+    int  active;     // pool threads working on the current job
+} ParPool_t;
+#endif
+
+// Shared state of a parallel apply or hash; chunk j covers slots
+// bounds[j] to bounds[j+1]-1
+typedef struct {
+    CSRMatrix_t* A;
+    int* bounds;     // chunk slot ranges
+    int  n;          // number of chunks
+    int* count;      // per chunk: zeros found, or entries kept, then the
+                     // chunk's first entry in the new storage
+    int* kept;       // per chunk: entries kept
+    int* slots;      // per chunk: slots kept, then its first new slot
+    int* len;        // per slot: entries kept
+    char* vals;      // new storage
+    int* cidx;
+    int* rptr;       // new row pointers
+    int* rid;        // new stored row ids, NULL in CSR mode
+    unsigned long long* sums; // per chunk: sum of cell hashes
+} ParApply_t;
+
+// Shared state of a parallel comparison
+typedef struct {
+    const int* a;
+    const int* b;
+    int  len;        // ints to compare
+    int  n;          // number of chunks
+    _Atomic int differ; // set once a chunk finds a difference
+} ParEqual_t;
+
+// Shared state of parallel printing
+typedef struct {
+    CSRMatrix_t* A;
+    int* bounds;     // chunk slot ranges
+    Writer_t** bufs; // output of each chunk
+    int  n;          // number of chunks
+    int* seq;        // entry printed at each position, NULL if the
+                     // entries print in storage order
+} ParPrint_t;
+
+// Parsed instruction
+typedef struct {
+    char op;         // opcode
+    int  arg[MAX_OP_ARGS]; // arguments, zero where not given
+} Instr_t;
+
+// When the column index is built
+typedef enum {
+    COLINDEX_OFF,    // never; column copies scan every stored row
+    COLINDEX_LAZY,   // on the first column copy in the instruction stream
+    COLINDEX_EAGER   // as soon as the current matrix is loaded
+} ColIndexMode_t;
+
+// Output produced after each instruction
+typedef enum {
+    OUTPUT_FULL,     // current and target matrices in full
+    OUTPUT_DELTA,    // only the cells the instruction changed
+    OUTPUT_SUMMARY   // nothing until the final verdict
+} OutputMode_t;
+
+// Matrix cell in logical coordinates
+typedef struct {
+    int  r;
+    int  c;
+    int  val;
+} Cell_t;
+
+// Cells read for one block of rows of a matrix being spilled. Every
+// SPILL_CHUNK of them go out to a temporary file as a chunk, so the block
+// can be read back in input order once the whole matrix has been read.
+typedef struct {
+    Cell_t* buf;     // cells not yet written out, NULL until the first
+    int  n;          // number of cells in buf
+    int* chunks;     // positions of the block's chunks in the file
+    int  nchunks;    // number of chunks written
+    int  cap;        // capacity of chunks
+} SpillBlock_t;
+
+// Growable list of cells
+typedef struct {
+    Cell_t* cells;
+    int  n;
+    int  cap;
+} CellList_t;
+
+// Sequence search settings
+typedef struct {
+    int  enabled;    // set to search instead of replaying instructions
+    int  max_depth;  // longest sequence searched
+    int  threads;    // number of worker threads
+    long budget;     // bytes of states stored before giving up
+} SearchConfig_t;
+
+// Settings shared by every run
+typedef struct {
+    OutputMode_t mode; // output after each instruction
+    ColIndexMode_t col_mode; // when to build the column index
+    SearchConfig_t search; // sequence search settings
+    char* spill_dir; // directory to spill the initial and target matrices
+                     // to, NULL to keep them in memory
+} RunConfig_t;
+
+// Batch settings
+typedef struct {
+    char* path;      // directory of inputs, or manifest listing one per
+                     // line; NULL to run stdin alone
+    char* out_dir;   // directory for one output file per input, NULL to
+                     // write all outputs to stdout in input order
+    int  threads;    // number of worker threads
+} BatchConfig_t;
+
+// Shared state of a batch run
+typedef struct {
+    BatchConfig_t* cfg;
+    RunConfig_t* run;
+    char** paths;    // inputs, in output order
+    int  n;          // number of inputs
+    _Atomic int next; // next unclaimed input
+    Writer_t** done; // finished outputs waiting for earlier ones
+    int  emitted;    // number of outputs written to stdout
+    pthread_mutex_t lock; // guards done and emitted
+    int  failures;   // inputs or outputs that could not be opened
+} Batch_t;
+
+// State reached by the search, with the instruction that first reached it
+typedef struct SearchNode {
+    struct SearchNode* parent; // state the instruction was applied to
+    unsigned long long key; // parent's index in its level, then the action's
+                     // index; the smallest key wins among equal states
+    unsigned long long hash; // matrix hash of the state
+    int  depth;      // number of instructions from the initial matrix
+    char op;         // opcode of the instruction
+    int  arg[MAX_OP_ARGS]; // its arguments
+    int  nnz;        // number of stored cells
+    int  nz;         // number of those that are non-zero
+    int  cells[];    // (row, col, val) of each stored cell, row-major
+} SearchNode_t;
+
+// One lock-protected part of the visited set: an open-addressing table
+typedef struct {
+    pthread_mutex_t lock;
+    SearchNode_t** slots; // states, NULL where free
+    long size;       // number of slots, a power of 2
+    long used;       // number of states
+} SearchStripe_t;
+
+// Shared state of a search
+typedef struct {
+    int  rows;       // matrix dimensions
+    int  cols;
+    int  max_depth;  // longest sequence searched
+    long budget;     // bytes of states allowed
+    _Atomic long bytes; // bytes of states stored
+    _Atomic long next; // next unclaimed state of the current level
+    _Atomic int stop; // set once the budget is used up
+    SearchNode_t* target; // target state
+    int* dense;      // target values, row-major
+    SearchNode_t** frontier; // states of the current level, in key order
+    long nfront;     // number of states in the current level
+    SearchNode_t* goal; // first goal state found, NULL if none
+    pthread_mutex_t goal_lock;
+    SearchStripe_t stripes[SEARCH_STRIPES]; // visited set, by hash
+} Search_t;
+
+// Per-thread search buffers
+typedef struct {
+    Search_t* S;     // search being run
+    int  id;         // worker number, 0 for the calling thread
+    int* dense;      // values of the state being expanded, row-major
+    int* vals;       // distinct current and target values
+    int* ks;         // candidate factors and addends
+    int  kcap;       // capacity of ks
+    Instr_t* acts;   // candidate instructions
+    int  nacts;
+    int  acap;
+    SearchNode_t** out; // new states for the next level
+    long nout;
+    long ocap;
+} SearchWorker_t;
+
+// Synthetic input settings, read from "key=value,..." workload specs
+typedef struct {
+    int  rows;       // matrix dimensions
+    int  cols;
+    long nnz;        // stored cells of each matrix, about
+    int  skew;       // the row of rank k holds about 1/k^skew of the cells;
+                     // 0 spreads them evenly
+    int  vmax;       // values are drawn from 1..vmax
+    long instrs;     // instructions after the matrices
+    int  mix[NUM_OPCODES]; // relative counts of the opcodes in OPCODES
+    unsigned long long seed; // random seed, so inputs are reproducible
+} GenConfig_t;
+
+// Profiled code: one site per opcode, in OPCODES order, then routines
+typedef enum {
+    PROF_PARSE = NUM_OPCODES, // reading instructions
+    PROF_READ,       // reading a matrix
+    PROF_EQUALS,     // solved checks
+    PROF_PRINT,
+    PROF_HASH,       // full rehashes
+    PROF_APPLY,      // applying the pending transform
+    PROF_MATERIALIZE, // applying the permutations, with row sorting
+    PROF_RELAYOUT,   // row mode changes
+    PROF_PACK,       // closing row gaps
+    PROF_SPREAD,     // respacing gapped rows
+    PROF_COPY,       // copying whole matrices
+    PROF_INDEX,      // building the column index
+    PROF_SITES
+} ProfSite_t;
+
+// Counters of one profiled site. Counts include nested sites, so an
+// opcode's time covers the routines it calls.
+typedef struct {
+    _Atomic long calls;
+    _Atomic long long ticks; // total time, in PROF_UNIT
+    _Atomic long long max;   // longest single call
+    _Atomic long long shifted; // entries and row slots moved in memory
+    _Atomic long reallocs;   // block resizes and storage regrowths
+} ProfCounters_t;
+
+// Profile of the whole run, reported at exit
+typedef struct {
+    int  on;         // set to collect counters
+    char* path;      // report file, NULL for stderr
+    int  json;       // set for a JSON report, else text
+    ProfCounters_t site[PROF_SITES];
+    _Atomic int peak_nnz; // largest nnz after an instruction
+    _Atomic int peak_cap; // largest storage capacity after an instruction
+} Profile_t;
+
+// Profiled routines running on one thread, innermost last
+typedef struct {
+    int  site[PROF_DEPTH];
+    unsigned long long start[PROF_DEPTH];
+    int  depth;      // may exceed PROF_DEPTH, when deeper calls go untimed
+} ProfStack_t;
+
+// Benchmark settings
+typedef struct {
+    char* scales;    // workload specs separated by ';', NULL to time none
+    char** checks;   // "INPUT:EXPECTED" pairs to cross-check, in order
+    int  nchecks;
+} BenchConfig_t;
+
 /* FUNCTION PROTOTYPES -------------------------------------------------------*/
+/* MEMORY MANAGEMENT ---------------------------------------------------------*/
+void*         mem_alloc(size_t);                  // counted malloc
+void*         mem_realloc(void*, size_t);         // counted realloc
+void          mem_free(void*);                    // counted free
+char*         storage_alloc(int*, int);           // get indices+values block
+void          storage_release(char*, int, int);   // return storage block
+void          scratch_reserve(long);              // grow idle scratch arena
+void*         scratch_alloc(long);                // temporary buffer
+long          scratch_mark(void);                 // current scratch position
+void          scratch_release(long);              // free buffers after mark
+void          mem_pool_free(void);                // release pooled memory
+void          report_alloc_stats(void);           // print counters to stderr
+int           alloc_stats_wanted(int, char**);    // check args/env for report
+
 /* INTERFACE FUNCTIONS FOR WORKING WITH CSR MATRICES -------------------------*/
 CSRMatrix_t*  csr_matrix_create(int, int);        // create empty CSR matrix
 void          csr_matrix_free(CSRMatrix_t*);      // free input CSR matrix
 int           csr_matrix_get(CSRMatrix_t*, int, int); // get matrix element
 void          csr_matrix_set(CSRMatrix_t*, int, int, int); // set matrix element
 int           csr_matrix_equals(CSRMatrix_t*, CSRMatrix_t*); // check equality
-CSRMatrix_t*  csr_matrix_read(int, int);          // read matrix from input
-void          csr_matrix_print(CSRMatrix_t*, char*); // print matrix
+CSRMatrix_t*  csr_matrix_read(Reader_t*, int, int); // read matrix from input
+CSRMatrix_t*  csr_matrix_build(int, int, int, int*, int*, int*); // bulk build
+void          csr_matrix_print(Writer_t*, CSRMatrix_t*, char*); // print matrix
+int*          print_sequence(CSRMatrix_t*);       // entries in input order
+void          read_dims(Reader_t*, int*, int*);   // read matrix dimensions
 CSRMatrix_t*  csr_matrix_copy(CSRMatrix_t*);      // copy matrix
+void          csr_matrix_will_write(CSRMatrix_t*); // before changing entries
+void          drop_print_order(CSRMatrix_t*);     // forget input order
 int           is_small_matrix(CSRMatrix_t*);      // check if matrix is small
+void          value_bound(CSRMatrix_t*, int);     // widen value bounds
+void          value_bounds_map(CSRMatrix_t*, int, int); // transform bounds
 void          resize_if_needed(CSRMatrix_t*);     // resize matrix if needed
+void          csr_matrix_reserve(CSRMatrix_t*, int); // ensure capacity
+int           val_width(int, int);                // bytes to store a range
+int           val_get(const char*, int, long);    // read a stored value
+void          val_put(char*, int, long, int);     // write a stored value
+void          vals_load(const char*, int, int*, int); // widen values to ints
+void          vals_store(const int*, char*, int, int); // narrow ints to values
+void          vals_convert(const char*, int, char*, int, int); // change width
+int           entry_value(CSRMatrix_t*, int);     // value of stored entry
+void          entry_store(CSRMatrix_t*, int, int); // set stored entry value
+char*         entry_vals(CSRMatrix_t*, int);      // address of entry value
+char*         storage_vals(char*, int);           // values of storage block
+void          storage_swap(CSRMatrix_t*, char*, int, int); // replace block
+void          csr_matrix_rewidth(CSRMatrix_t*, int); // change value width
+int           equal_vals(const char*, int, const char*, int, int); // compare
+int           affine_width(char*, int, int, int, int); // affine, any width
+int           compact_width(char*, int*, int, char*, int*, int, int, int);
+                                                  // compact, any width
 int           find_element_index(CSRMatrix_t*, int, int); // find element index
+int           find_insert_index(CSRMatrix_t*, int, int); // find insert index
+int           slot_row(CSRMatrix_t*, int);        // row stored in a slot
+int           row_lower_slot(CSRMatrix_t*, int);  // first slot not below row
+int           row_slot(CSRMatrix_t*, int);        // slot of row, -1 if none
+void          row_bounds(CSRMatrix_t*, int, int*, int*); // row entry range
+int           row_end(CSRMatrix_t*, int);         // end of a slot's entries
+void          shift_rptr(CSRMatrix_t*, int, int); // shift later row pointers
+int           row_open(CSRMatrix_t*, int);        // get or add row slot
+void          row_close(CSRMatrix_t*, int);       // drop slot if row empty
+int           row_use_gaps(CSRMatrix_t*, int);    // pick gapped layout
+void          row_make_room(CSRMatrix_t*, int, int); // grow slot capacity
+void          csr_matrix_spread(CSRMatrix_t*, int, int); // rebalance gaps
+void          csr_matrix_pack(CSRMatrix_t*);      // remove gaps between rows
+void          csr_matrix_to_csr(CSRMatrix_t*);    // switch to CSR mode
+void          csr_matrix_to_dcsr(CSRMatrix_t*);   // switch to DCSR mode
+void          csr_matrix_pick_layout(CSRMatrix_t*); // pick mode by density
+int           compare_keys(const void*, const void*); // qsort comparator
+void          csr_matrix_materialize(CSRMatrix_t*); // apply pending permutation
+int           csr_matrix_contains(CSRMatrix_t*, CSRMatrix_t*); // subset check
+void          sort_row_segment(CSRMatrix_t*, int, int); // sort entries by column
+void          purge_row_zeros(CSRMatrix_t*, int); // drop stored zeros in row
+int*          identity_map(int);                  // allocate identity mapping
+int           transformed_value(CSRMatrix_t*, int); // apply pending transform
+void          csr_matrix_apply(CSRMatrix_t*);     // flush pending transform
+void          apply_rows(CSRMatrix_t*);           // apply transform by rows
+unsigned long long cell_hash(int, int, int);      // hash one matrix cell
+unsigned long long csr_matrix_hash(CSRMatrix_t*); // hash of whole matrix
+unsigned long long row_hash(CSRMatrix_t*, int, int); // hash of one row
+void          hash_row(CSRMatrix_t*, int, int, int); // add/remove row hash
+void          hash_col(CSRMatrix_t*, int, int, int); // relabel column hash
+void          entry_insert(CSRMatrix_t*, int, int, int); // add stored entry
+void          entry_remove(CSRMatrix_t*, int, int); // remove stored entry
+void          csr_matrix_index_cols(CSRMatrix_t*); // build column index
+void          csr_matrix_drop_index(CSRMatrix_t*); // discard column index
+void          col_index_add(ColIndex_t*, int, int); // list row in column
+void          col_index_remove(ColIndex_t*, int, int); // unlist row
+void          col_index_row(CSRMatrix_t*, int, int); // (un)list a whole row
+ColIndexMode_t column_index_mode(int, char**);    // select mode from args/env
+#ifdef CSR_DEBUG
+int           csr_matrix_check(CSRMatrix_t*);     // validate CSR invariants
+#endif
 
 // Operation prototypes
 void op_set(CSRMatrix_t*, int, int, int);
@@ -87,202 +670,533 @@ void op_multiply(CSRMatrix_t*, int);
 void op_add(CSRMatrix_t*, int);
 void op_copy_row(CSRMatrix_t*, int, int);
 void op_copy_col(CSRMatrix_t*, int, int);
+void op_copy_col_indexed(CSRMatrix_t*, int, int, int);
 void op_swap_row(CSRMatrix_t*, int, int);
 void op_swap_col(CSRMatrix_t*, int, int);
-void matrix_sort(CSRMatrix_t *mat);
+
+// Instruction handlers, taking arguments in parse order
+void run_set(CSRMatrix_t*, int*);
+void run_swap(CSRMatrix_t*, int*);
+void run_multiply(CSRMatrix_t*, int*);
+void run_add(CSRMatrix_t*, int*);
+void run_copy_row(CSRMatrix_t*, int*);
+void run_copy_col(CSRMatrix_t*, int*);
+void run_swap_row(CSRMatrix_t*, int*);
+void run_swap_col(CSRMatrix_t*, int*);
+
+// Input parsing functions
+Reader_t*     reader_create(FILE*);               // map or buffer input
+void          reader_free(Reader_t*);             // release input buffer
+int           reader_fill(Reader_t*);             // read next block of stream
+char*         reader_line(Reader_t*, int*);       // next line and its length
+const char*   scan_int(const char*, const char*, int*); // parse one integer
+int           scan_ints(const char*, const char*, int*, int); // parse a,b,...
+
+// Output mode functions
+OutputMode_t  output_mode(int, char**);           // select mode from args/env
+void          cell_list_push(CellList_t*, int, int, int); // append cell
+void          collect_row_cells(CSRMatrix_t*, int, CellList_t*); // row cells
+void          collect_col_cells(CSRMatrix_t*, int, CellList_t*); // col cells
+void          collect_region(CSRMatrix_t*, char, int*, CellList_t*); // op cells
+int           compare_cells(const void*, const void*); // qsort comparator
+void          print_delta(Writer_t*, CellList_t*, CellList_t*, int); // changes
+
+// Buffered output functions
+Writer_t*     writer_create(FILE*);               // create output buffer
+void          writer_free(Writer_t*);             // flush and free buffer
+void          writer_flush(Writer_t*);            // write out pending bytes
+char*         writer_space(Writer_t*, int);       // make room for n bytes
+void          write_str(Writer_t*, const char*);  // append string
+void          write_bytes(Writer_t*, const char*, int); // append n bytes
+void          write_int(Writer_t*, int);          // append decimal integer
+void          write_fmt(Writer_t*, const char*, ...); // append formatted text
 
 // Solution handling function
-void print_solution_and_cleanup(CSRMatrix_t*, CSRMatrix_t*, CSRMatrix_t*, int);
+void print_solution_and_cleanup(Writer_t*, CSRMatrix_t*, CSRMatrix_t*, 
+                                CSRMatrix_t*, int);
 void cleanup_matrices(CSRMatrix_t*, CSRMatrix_t*, CSRMatrix_t*);
+void run_puzzle(Reader_t*, Writer_t*, RunConfig_t*); // process one input
+
+// Instruction fusion, for runs without per-step output
+int           fuse_fill(Reader_t*, Instr_t*, int*); // read instruction window
+int           fuse_overwritten(Instr_t*, Instr_t*, CSRMatrix_t*); // dead set
+int           csr_matrix_probe_differs(CSRMatrix_t*, CSRMatrix_t*); // quick
+int           run_fused(Reader_t*, CSRMatrix_t*, CSRMatrix_t*, int*); // run all
+
+// Parallel execution of whole-matrix operations
+void          par_config(int, char**);            // read thread count
+int           par_threads(void);                  // threads per operation
+#ifdef HAVE_THREADS
+void          par_work(ParJob_t*);                // run chunks of a job
+void*         par_worker(void*);                  // pool thread
+void          par_start(void);                    // start pool threads
+#endif
+void          par_run(int, void (*)(void*, int), void*); // run chunks
+int           par_split(CSRMatrix_t*, int, long, int*, int); // chunk slots
+int           par_chunks(CSRMatrix_t*, int*);     // nnz-balanced chunks
+void          par_affine(void*, int);             // apply chunks
+void          par_compact(void*, int);
+void          par_place(void*, int);
+void          csr_matrix_apply_par(CSRMatrix_t*, int*, int); // parallel apply
+void          par_hash(void*, int);               // hash chunk
+void          par_equal(void*, int);              // comparison chunk
+int           equal_ints_par(const int*, const int*, int); // compare arrays
+void          par_print(void*, int);              // print chunk
+void          csr_matrix_print_par(Writer_t*, CSRMatrix_t*, int*); // list
+
+// Vector kernels, with a scalar fallback
+int           affine_scalar(int*, int, int, int); // v*scale+offset in place
+int           compact_scalar(int*, int*, int, int*, int*, int, int); // and pack
+int           equal_ints(const int*, const int*, int); // compare arrays
+#ifdef HAVE_X86_SIMD
+int           affine_sse2(int*, int, int, int);
+int           affine_avx2(int*, int, int, int);
+int           compact_avx2(int*, int*, int, int*, int*, int, int);
+#endif
+int           kernels_select(const char*, Kernels_t*); // get a code path
+void          kernels_init(void);                 // pick the best code path
+int           bench_kernels(Writer_t*);           // time every code path
+
+// Binary snapshot functions
+long long     snap_layout(SnapHeader_t*);         // section offsets, file size
+unsigned long long snap_checksum(unsigned long long, const int*, int); // mix
+int           snap_save(const char*, CSRMatrix_t*); // write snapshot file
+CSRMatrix_t*  snap_load(const char*, int, int, int); // map snapshot file
+CSRMatrix_t*  snap_line_load(char*, int, int, int); // load named snapshot
+void          snap_fail(const char*, const char*, ...); // report, exit
+int           snap_valid(CSRMatrix_t*);           // check snapshot rows
+void          snap_unmap(char*, long);            // release snapshot file
+int           convert_input(Reader_t*, char*, char*); // text to snapshots
+char*         spill_config(int, char**);          // read spill directory
+FILE*         spill_open(const char*, char**);    // create spill file
+void          spill_block_add(SpillBlock_t*, FILE*, int*, Cell_t); // buffer
+int           spill_copy(FILE*, FILE*, int, unsigned long long*); // section
+CSRMatrix_t*  spill_read(Reader_t*, int, int, const char*); // build to file
+
+// Batch functions
+void          batch_config(int, char**, BatchConfig_t*); // read settings
+int           batch_list(const char*, char***);   // list batch inputs
+int           compare_strings(const void*, const void*); // qsort comparator
+void          batch_run_one(Batch_t*, int);       // run one batch input
+void          batch_emit(Batch_t*, int, Writer_t*); // write outputs in order
+void*         batch_worker(void*);                // run claimed inputs
+int           run_batch(BatchConfig_t*, RunConfig_t*); // run every input
+
+// Sequence search functions
+void          search_config(int, char**, SearchConfig_t*); // read settings
+SearchNode_t* search_node(Search_t*, CSRMatrix_t*); // record matrix state
+CSRMatrix_t*  search_matrix(Search_t*, SearchNode_t*); // rebuild state
+void          search_free_node(Search_t*, SearchNode_t*); // free a state
+int           search_same(SearchNode_t*, SearchNode_t*); // equal states
+int           search_insert(Search_t*, SearchNode_t*); // add to visited set
+int           search_bound(Search_t*, SearchNode_t*); // steps left, at least
+void          search_push_action(SearchWorker_t*, char, int, int, int, int);
+void          search_actions(Search_t*, SearchWorker_t*, int*, int); // moves
+void          search_expand(Search_t*, SearchWorker_t*, SearchNode_t*, long);
+void*         search_worker(void*);               // expand claimed states
+int           compare_node_keys(const void*, const void*); // qsort comparator
+int           compare_ints(const void*, const void*); // qsort comparator
+int           unique_values(int*, int);           // sort and deduplicate
+void          search_and_print(Writer_t*, CSRMatrix_t*, CSRMatrix_t*, 
+                               SearchConfig_t*); // find shortest sequence
+
+// Workload generation and benchmark functions
+int           gen_parse(const char*, GenConfig_t*); // read workload spec
+unsigned long long gen_rand(unsigned long long*); // next random number
+long          gen_below(unsigned long long*, long); // random in 0..n-1
+void          gen_matrix(Writer_t*, GenConfig_t*, unsigned long long*);
+void          gen_input(Writer_t*, GenConfig_t*);   // write whole input
+int           run_generate(Writer_t*, const char*); // input from a spec
+void          bench_config(int, char**, BenchConfig_t*); // read settings
+double        bench_now(void);                    // wall-clock seconds
+void          bench_row(Writer_t*, const char*, CSRMatrix_t*, const char*, 
+                        long, double, const char*); // write one result
+int           bench_check(Writer_t*, char*, RunConfig_t*); // compare output
+int           bench_workload(Writer_t*, const char*, RunConfig_t*); // time
+int           run_bench(BenchConfig_t*, RunConfig_t*); // run all benchmarks
+
+// Profiling functions
+void          profile_config(int, char**);        // enable from args/env
+#ifdef PROFILE
+unsigned long long prof_clock(void);              // current time in PROF_UNIT
+void          prof_max(_Atomic long long*, long long); // raise to at least
+void          prof_begin(int);                    // enter a site
+void          prof_end(int);                      // leave the innermost site
+void          prof_shift(long);                   // count moved entries
+void          prof_realloc(void);                 // count a resize
+void          prof_peak(CSRMatrix_t*);            // track peak nnz, capacity
+void          report_profile(void);               // write report at exit
+#endif
+
+// Instruction table, indexed by opcode; unknown opcodes end processing
+static const OpEntry_t OPS[UCHAR_MAX + 1] = {
+    ['s'] = {run_set, 1, 3},
+    ['S'] = {run_swap, 1, 4},
+    ['m'] = {run_multiply, 1, 1},
+    ['a'] = {run_add, 1, 1},
+    ['r'] = {run_copy_row, 2, 2},
+    ['c'] = {run_copy_col, 2, 2},
+    ['R'] = {run_swap_row, 2, 2},
+    ['C'] = {run_swap_col, 2, 2},
+};
+
+// Kernel code path in use, set once by kernels_init
+static Kernels_t kernels;
+
+#ifdef PROFILE
+// Profile counters, and the sites open on each thread
+static Profile_t profile;
+static _Thread_local ProfStack_t prof_stack;
+#endif
+
+#ifdef HAVE_THREADS
+// Thread pool for large operations, sized once by par_config
+static ParPool_t par_pool;
+static pthread_once_t par_once = PTHREAD_ONCE_INIT;
+#endif
 
 /* WHERE IT ALL HAPPENS ------------------------------------------------------*/
-int main(void) {
-    int stage = 0, rows, cols;
-    char line[MAX_LINE_LEN];
+int main(int argc, char *argv[]) {
+    kernels_init();
+    par_config(argc, argv);
+    char *snap_paths[2] = {NULL, NULL};
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--bench-kernels") == 0) {
+            Writer_t *out = writer_create(stdout);
+            int status = bench_kernels(out);
+            writer_free(out);
+            return status;
+        } else if (strncmp(argv[i], "--generate=", 11) == 0) {
+            Writer_t *out = writer_create(stdout);
+            int status = run_generate(out, argv[i] + 11);
+            writer_free(out);
+            return status;
+        } else if (strncmp(argv[i], "--convert-initial=", 18) == 0) {
+            snap_paths[0] = argv[i] + 18;
+        } else if (strncmp(argv[i], "--convert-target=", 17) == 0) {
+            snap_paths[1] = argv[i] + 17;
+        }
+    }
+    // Turn the matrices of stdin into snapshot files, without running
+    if (snap_paths[0] != NULL || snap_paths[1] != NULL) {
+        Reader_t *in = reader_create(stdin);
+        int status = convert_input(in, snap_paths[0], snap_paths[1]);
+        reader_free(in);
+        return status;
+    }
+    RunConfig_t cfg;
+    cfg.mode = output_mode(argc, argv);
+    cfg.col_mode = column_index_mode(argc, argv);
+    search_config(argc, argv, &cfg.search);
+    cfg.spill_dir = spill_config(argc, argv);
+    if (alloc_stats_wanted(argc, argv)) {
+        atexit(report_alloc_stats);
+    }
+    profile_config(argc, argv);
+    // Time synthetic workloads or cross-check reference outputs
+    BenchConfig_t bench;
+    bench_config(argc, argv, &bench);
+    if (bench.scales != NULL || bench.nchecks > 0) {
+        return run_bench(&bench, &cfg);
+    }
+    // Run a whole batch of inputs, or just the one on stdin
+    BatchConfig_t batch;
+    batch_config(argc, argv, &batch);
+    if (batch.path != NULL) {
+        return run_batch(&batch, &cfg);
+    }
+    Writer_t *out = writer_create(stdout);
+    Reader_t *in = reader_create(stdin);
+    run_puzzle(in, out, &cfg);
+    writer_free(out);
+    reader_free(in);
+    return EXIT_SUCCESS;
+}
+
+// Read one input (matrices, then instructions) from in and write its
+// stages to out. Everything a run uses is reached from in, out and cfg, so
+// runs on different threads are independent.
+void run_puzzle(Reader_t *in, Writer_t *out, RunConfig_t *cfg) {
+    int stage = 0, rows = 0, cols = 0, len;
+    char *line;
+    OutputMode_t mode = cfg->mode;
     // Stage 0 initialization
-    printf(SDELIM, stage++);    // print Stage 0 header
-    // Read matrix dimensions
-    fgets(line, MAX_LINE_LEN, stdin);
-    assert(sscanf(line, MTXDIM, &rows, &cols) == 2);
-    // Create initial and target matrices
-    CSRMatrix_t* initial = csr_matrix_read(rows, cols);
-    CSRMatrix_t* target = csr_matrix_read(rows, cols);
+    if (mode != OUTPUT_SUMMARY) {
+        write_fmt(out, SDELIM, stage);    // print Stage 0 header
+    }
+    stage++;
+    read_dims(in, &rows, &cols);
+    // Create initial and target matrices; when spilling, each is built
+    // straight into a file, so only current stays in memory
+    CSRMatrix_t* initial = spill_read(in, rows, cols, cfg->spill_dir);
+    CSRMatrix_t* target = spill_read(in, rows, cols, cfg->spill_dir);
+    // Snapshot matrices stay mapped read-only, so only current is copied
     CSRMatrix_t* current = csr_matrix_copy(initial);
+    // The current matrix is driven towards the target, so size it for both
+    csr_matrix_reserve(current, target->nnz);
+    current->use_csc = (cfg->col_mode != COLINDEX_OFF);
+    if (cfg->col_mode == COLINDEX_EAGER) {
+        csr_matrix_index_cols(current);
+    }
     // Print initial and target matrices
-    csr_matrix_print(initial, "Initial matrix");
-    printf("%s\n", DELIMITER);
-    csr_matrix_print(target, "Target matrix");
+    if (mode != OUTPUT_SUMMARY) {
+        csr_matrix_print(out, initial, "Initial matrix");
+        write_str(out, DELIMITER "\n");
+        csr_matrix_print(out, target, "Target matrix");
+    }
+    // Search for a shortest sequence instead of replaying instructions
+    if (cfg->search.enabled) {
+        search_and_print(out, initial, target, &cfg->search);
+        cleanup_matrices(initial, target, current);
+        return;
+    }
     // Check if already solved
-    if (csr_matrix_equals(current, target)) {
-        print_solution_and_cleanup(initial, target, current, 0);
-        return EXIT_SUCCESS;
+    PROF_BEGIN(PROF_EQUALS);
+    int solved = csr_matrix_equals(current, target);
+    PROF_END(PROF_EQUALS);
+    if (solved) {
+        if (mode == OUTPUT_SUMMARY) {
+            write_str(out, "Steps executed: 0\n");
+        }
+        print_solution_and_cleanup(out, initial, target, current, 0);
+        return;
     }
     int step_count = 0;
+    // Without per-step output, instructions go through the fusing window
+    if (mode == OUTPUT_SUMMARY) {
+        if (run_fused(in, current, target, &step_count)) {
+            write_fmt(out, "Steps executed: %d\n", step_count);
+            print_solution_and_cleanup(out, initial, target, current, 
+                                       step_count);
+            return;
+        }
+        write_fmt(out, "Steps executed: %d\nNOT SOLVED\n", step_count);
+        write_str(out, THEEND);
+        cleanup_matrices(initial, target, current);
+        return;
+    }
+    CellList_t before = {NULL, 0, 0}, after = {NULL, 0, 0};
     int stage1_printed = 0;
     int stage2_printed = 0;
     // Process operations
-    while (fgets(line, MAX_LINE_LEN, stdin)) {
-        // Remove newline and skip empty lines
-        line[strcspn(line, "\n")] = 0;  
-        if (strlen(line) == 0) continue;
+    while ((line = reader_line(in, &len)) != NULL) {
+        // Skip empty lines
+        if (len == 0) continue;
         char op_type = line[0];
+        const OpEntry_t *op = &OPS[(unsigned char)op_type];
         // Check for stage 2 operations
-        int is_stage2_op = (op_type == 'r' || op_type == 'c' 
-                         || op_type == 'R' || op_type == 'C');
+        int is_stage2_op = (op->stage == 2);
         // Print stage headers when needed
         if (!stage1_printed && stage == 1) {
-            printf(SDELIM, stage++);  // Print Stage 1 header
+            write_fmt(out, SDELIM, stage++);  // Print Stage 1 header
             stage1_printed = 1;
         }
         if (is_stage2_op && !stage2_printed) {
-            printf(SDELIM, stage++);  // Print Stage 2 header
+            write_fmt(out, SDELIM, stage++);  // Print Stage 2 header
             stage2_printed = 1;
         }
         // Print instruction
-        printf("INSTRUCTION %s\n", line);
-        // Parse and execute operation
-        if (op_type == 's') {
-            int r, c, val;
-            sscanf(line + 2, "%d,%d,%d", &r, &c, &val);
-            op_set(current, r, c, val);
-        } else if (op_type == 'S') {
-            int r1, c1, r2, c2;
-            sscanf(line + 2, "%d,%d,%d,%d", &r1, &c1, &r2, &c2);
-            op_swap(current, r1, c1, r2, c2);
-        } else if (op_type == 'm') {
-            int val;
-            sscanf(line + 2, "%d", &val);
-            op_multiply(current, val);
-        } else if (op_type == 'a') {
-            int val;
-            sscanf(line + 2, "%d", &val);
-            op_add(current, val);
-        } else if (op_type == 'r') {
-            int r1, r2;
-            sscanf(line + 2, "%d,%d", &r1, &r2);
-            op_copy_row(current, r1, r2);
-        } else if (op_type == 'c') {
-            int c1, c2;
-            sscanf(line + 2, "%d,%d", &c1, &c2);
-            op_copy_col(current, c1, c2);
-        } else if (op_type == 'R') {
-            int r1, r2;
-            sscanf(line + 2, "%d,%d", &r1, &r2);
-            op_swap_row(current, r1, r2);
-        } else if (op_type == 'C') {
-            int c1, c2;
-            sscanf(line + 2, "%d,%d", &c1, &c2);
-            op_swap_col(current, c1, c2);
-        } else {
+        write_str(out, "INSTRUCTION ");
+        memcpy(writer_space(out, len + 1), line, len);
+        out->len += len;
+        out->buf[out->len++] = '\n';
+        // Parse operation arguments
+        PROF_BEGIN(PROF_PARSE);
+        int arg[MAX_OP_ARGS] = {0, 0, 0, 0};
+        if (len > 2) {
+            scan_ints(line + 2, line + len, arg, MAX_OP_ARGS);
+        }
+        PROF_END(PROF_PARSE);
+        if (op->run == NULL) {
             break;
         }
+        if (mode == OUTPUT_DELTA) {
+            collect_region(current, op_type, arg, &before);
+        }
+        // Execute operation
+        PROF_BEGIN(strchr(OPCODES, op_type) - OPCODES);
+        op->run(current, arg);
+        PROF_END(strchr(OPCODES, op_type) - OPCODES);
+        PROF_PEAK(current);
         step_count++;
-        // sort
-        matrix_sort(current);
-        // Print current and target matrices
-        csr_matrix_print(current, "Current matrix");
-        csr_matrix_print(target, "Target matrix");
+        // Every operation keeps column indices sorted within each row
+        CSR_CHECK(current);
+        // Print current and target matrices, or just what changed
+        if (mode == OUTPUT_FULL) {
+            csr_matrix_print(out, current, "Current matrix");
+            csr_matrix_print(out, target, "Target matrix");
+        } else if (mode == OUTPUT_DELTA) {
+            collect_region(current, op_type, arg, &after);
+            // Only an add can remove entries when applied, and its step has
+            // just collected every row, so the transform stays lazy otherwise
+            if (current->drop) {
+                csr_matrix_apply(current);
+            }
+            print_delta(out, &before, &after, current->nnz);
+        }
         // Check if solved
-        if (csr_matrix_equals(current, target)) {
-            print_solution_and_cleanup(initial, target, current, step_count);
-            return EXIT_SUCCESS;
+        PROF_BEGIN(PROF_EQUALS);
+        solved = csr_matrix_equals(current, target);
+        PROF_END(PROF_EQUALS);
+        if (solved) {
+            mem_free(before.cells);
+            mem_free(after.cells);
+            print_solution_and_cleanup(out, initial, target, current, 
+                                       step_count);
+            return;
         }
     }
     // No solution found
-    printf(THEEND);
+    mem_free(before.cells);
+    mem_free(after.cells);
+    write_str(out, THEEND);
     cleanup_matrices(initial, target, current);
-    return EXIT_SUCCESS;
 }
 
-void matrix_sort(CSRMatrix_t *mat) {
-    if (mat->nnz <= 1) {
-        return;
+/* Memory management ---------------------------------------------------------*/
+
+static AllocStats_t alloc_stats;
+static _Thread_local MemPool_t pool;
+
+// Allocate size bytes, counting the allocation
+void* mem_alloc(size_t size) {
+    void *p = malloc(size > 0 ? size : 1);
+    assert(p != NULL);
+    alloc_stats.allocs++;
+    return p;
+}
+
+// Resize block p to size bytes, counting a fresh block as an allocation
+void* mem_realloc(void *p, size_t size) {
+    if (p == NULL) {
+        alloc_stats.allocs++;
+    } else {
+        alloc_stats.reallocs++;
+        PROF_REALLOC();
     }
+    p = realloc(p, size > 0 ? size : 1);
+    assert(p != NULL);
+    return p;
+}
 
-    // Extract all non-zero elements as (row, col, val)
-    int *rows_array = malloc(sizeof(int) * mat->nnz);
-    int *cols_array = malloc(sizeof(int) * mat->nnz);
-    int *vals_array = malloc(sizeof(int) * mat->nnz);
-    assert(rows_array && cols_array && vals_array);
+// Free block p, if any
+void mem_free(void *p) {
+    if (p != NULL) {
+        alloc_stats.frees++;
+        free(p);
+    }
+}
 
-    // Extract data from CSR format
-    int idx = 0;
-    for (int r = 0; r < mat->rows; r++) {
-        for (int i = mat->rptr[r]; i < mat->rptr[r + 1]; i++) {
-            rows_array[idx] = r;
-            cols_array[idx] = mat->cidx[i];
-            vals_array[idx] = mat->vals[i];
-            idx++;
-        }
+// Get a block holding *cap column indices followed by *cap values of w
+// bytes each. The spare block is reused when large enough, in which case
+// *cap is raised to as many entries as it holds.
+char* storage_alloc(int *cap, int w) {
+    if (*cap < 1) {
+        *cap = 1;
     }
+    long size = (long)(sizeof(int) + w) * *cap;
+    if (pool.spare != NULL && pool.spare_size >= size) {
+        char *block = pool.spare;
+        long fit = pool.spare_size / (long)(sizeof(int) + w);
+        *cap = (fit > INT_MAX) ? INT_MAX : (int)fit;
+        pool.spare = NULL;
+        alloc_stats.reuses++;
+        return block;
+    }
+    return (char*)mem_alloc((size_t)size);
+}
 
-    // Bubble sort in row-major order
-    for (int i = 0; i < mat->nnz - 1; i++) {
-        for (int j = i + 1; j < mat->nnz; j++) {
-            int swap_needed = 0;
+// Return a storage block of capacity cap and value width w, keeping the
+// larger of it and the current spare block for reuse
+void storage_release(char *block, int cap, int w) {
+    if (block == NULL) {
+        return;
+    }
+    long size = (long)(sizeof(int) + w) * cap;
+    if (pool.spare == NULL || size > pool.spare_size) {
+        mem_free(pool.spare);
+        pool.spare = block;
+        pool.spare_size = size;
+    } else {
+        mem_free(block);
+    }
+}
 
-            // First compare rows
-            if (rows_array[i] > rows_array[j]) {
-                swap_needed = 1;
-            }
-            // If rows are equal, compare columns
-            else if (rows_array[i] == rows_array[j] && 
-                     cols_array[i] > cols_array[j]) {
-                swap_needed = 1;
-            }
+// Make room for bytes more scratch memory. The arena can only move while
+// it is empty, so callers reserve the total of their buffers up front.
+void scratch_reserve(long bytes) {
+    if (pool.scratch_used + bytes <= pool.scratch_size) {
+        return;
+    }
+    assert(pool.scratch_used == 0);
+    long size = (pool.scratch_size > 0) ? pool.scratch_size : SCRATCH_ALIGN;
+    while (size < bytes) {
+        size *= GROWTH_FACTOR;
+    }
+    mem_free(pool.scratch);
+    pool.scratch = (char*)mem_alloc(size);
+    pool.scratch_size = size;
+    if (size > alloc_stats.scratch_peak) {
+        alloc_stats.scratch_peak = size;
+    }
+}
 
-            if (swap_needed) {
-                // Swap elements across the three arrays
-                int temp;
+// Take an aligned temporary buffer of bytes from the scratch arena
+void* scratch_alloc(long bytes) {
+    long at = (pool.scratch_used + SCRATCH_ALIGN - 1) 
+            & ~(long)(SCRATCH_ALIGN - 1);
+    scratch_reserve(at + bytes - pool.scratch_used);
+    pool.scratch_used = at + bytes;
+    return pool.scratch + at;
+}
 
-                temp = rows_array[i];
-                rows_array[i] = rows_array[j];
-                rows_array[j] = temp;
+// Current top of the scratch arena, to pass to scratch_release
+long scratch_mark(void) {
+    return pool.scratch_used;
+}
 
-                temp = cols_array[i];
-                cols_array[i] = cols_array[j];
-                cols_array[j] = temp;
+// Release all scratch buffers taken since mark
+void scratch_release(long mark) {
+    assert(mark <= pool.scratch_used);
+    pool.scratch_used = mark;
+}
 
-                temp = vals_array[i];
-                vals_array[i] = vals_array[j];
-                vals_array[j] = temp;
-            }
-        }
-    }
+// Free the spare storage block and the scratch arena
+void mem_pool_free(void) {
+    mem_free(pool.spare);
+    mem_free(pool.scratch);
+    pool.spare = NULL;
+    pool.scratch = NULL;
+    pool.spare_size = 0;
+    pool.scratch_size = pool.scratch_used = 0;
+}
 
-    // Write the sorted data back to CSR format
-    // Rebuild rptr, cidx, vals
-    for (int i = 0; i <= mat->rows; i++) {
-        mat->rptr[i] = 0;
-    }
+// Print the allocation counters to stderr
+void report_alloc_stats(void) {
+    fprintf(stderr, "allocations: %ld, reallocations: %ld, frees: %ld, "
+            "pool reuses: %ld, scratch peak: %ld bytes\n", 
+            alloc_stats.allocs, alloc_stats.reallocs, alloc_stats.frees, 
+            alloc_stats.reuses, alloc_stats.scratch_peak);
+}
 
-    // Reconstruct CSR structure
-    idx = 0;
-    for (int r = 0; r < mat->rows; r++) {
-        mat->rptr[r] = idx;
-        // Collect all elements belonging to row r
-        for (int i = 0; i < mat->nnz; i++) {
-            if (rows_array[i] == r) {
-                mat->cidx[idx] = cols_array[i];
-                mat->vals[idx] = vals_array[i];
-                idx++;
-            }
+// Check for --alloc-stats, or ALLOC_STATS_ENV set to a non-empty value
+int alloc_stats_wanted(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--alloc-stats") == 0) {
+            return 1;
         }
     }
-    mat->rptr[mat->rows] = mat->nnz;
-
-    // Free temporary arrays
-    free(rows_array);
-    free(cols_array);
-    free(vals_array);
+    char *env = getenv(ALLOC_STATS_ENV);
+    return env != NULL && env[0] != '\0';
 }
 
 /* CSR matrix implementation -------------------------------------------------*/
 
-// Create an empty CSR matrix of nrows rows and ncols columns
+// Create an empty CSR matrix of nrows rows and ncols columns; an empty
+// matrix stores no rows, so it starts in hypersparse (DCSR) mode
 CSRMatrix_t *csr_matrix_create(int nrows, int ncols) {
     assert(nrows >= 0 && ncols >= 0);
-    CSRMatrix_t *A = (CSRMatrix_t*)malloc(sizeof(CSRMatrix_t));
+    CSRMatrix_t *A = (CSRMatrix_t*)mem_alloc(sizeof(CSRMatrix_t));
     assert(A != NULL);
     A->rows = nrows;
     A->cols = ncols;
@@ -290,341 +1204,4929 @@ CSRMatrix_t *csr_matrix_create(int nrows, int ncols) {
     A->cap = INITIAL_CAPACITY;
     A->vals = NULL;
     A->cidx = NULL;
-    A->rptr = (int*)malloc((size_t)(A->rows + 1) * sizeof(int));
-    assert(A->rptr != NULL);
-    for (int i = 0; i <= A->rows; i++) {
-        A->rptr[i] = 0;
-    }
+    A->vbytes = 1;
+    A->nrs = 0;
+    A->rcap = 1;
+    A->rend = NULL;
+    A->pord = NULL;
+    A->rperm = NULL;
+    A->rinv = NULL;
+    A->cperm = NULL;
+    A->cinv = NULL;
+    A->zeros = 0;
+    A->scale = 1;
+    A->offset = 0;
+    A->drop = 0;
+    A->vlo = INT_MAX;
+    A->vhi = INT_MIN;
+    A->hash = 0;
+    A->hashed = 1;
+    A->csc = NULL;
+    A->use_csc = 0;
+    A->snap = NULL;
+    A->snap_len = 0;
+    A->rid = (int*)mem_alloc(sizeof(int) * A->rcap);
+    A->rptr = (int*)mem_alloc(sizeof(int) * A->rcap);
+    assert(A->rid != NULL && A->rptr != NULL);
+    A->rptr[0] = 0;
     return A;
 }
 
 // Free input CSR matrix A
 void csr_matrix_free(CSRMatrix_t *A) {
     assert(A != NULL);
-    free(A->vals);
-    free(A->cidx);
-    free(A->rptr);
-    free(A);
+    csr_matrix_drop_index(A);
+    drop_print_order(A);
+    if (A->snap != NULL) {
+        snap_unmap(A->snap, A->snap_len);
+    } else {
+        storage_release((char*)A->cidx, A->cap, A->vbytes);
+        mem_free(A->rptr);
+        mem_free(A->rid);
+    }
+    mem_free(A->rend);
+    mem_free(A->rperm);
+    mem_free(A->rinv);
+    mem_free(A->cperm);
+    mem_free(A->cinv);
+    mem_free(A);
 }
 
 // Resize CSR matrix if necessary
 void resize_if_needed(CSRMatrix_t *A) {
-    if (A->nnz >= A->cap) {
-        int new_cap = (A->cap == 0) ? 1 : A->cap * GROWTH_FACTOR;
-        A->vals = (int*)realloc(A->vals, sizeof(int) * new_cap);
-        A->cidx = (int*)realloc(A->cidx, sizeof(int) * new_cap);
-        assert(A->vals != NULL && A->cidx != NULL);
-        A->cap = new_cap;
-    }
+    csr_matrix_reserve(A, A->nnz + 1);
 }
 
-// Find index of element at (r,c) in CSR matrix
-int find_element_index(CSRMatrix_t *A, int r, int c) {
-    for (int i = A->rptr[r]; i < A->rptr[r + 1]; i++) {
-        if (A->cidx[i] == c) {
-            return i;
+// Grow capacity geometrically until it can hold at least n non-zero values
+void csr_matrix_reserve(CSRMatrix_t *A, int n) {
+    if (n > A->cap) {
+        int new_cap = (A->cap == 0) ? 1 : A->cap;
+        while (new_cap < n) {
+            new_cap *= GROWTH_FACTOR;
         }
+        assert(A->snap == NULL);
+        PROF_REALLOC();
+        char *block = storage_alloc(&new_cap, A->vbytes);
+        int used = (A->rend != NULL) ? A->rptr[A->nrs] : A->nnz;
+        if (used > 0) {
+            memcpy(block, A->cidx, sizeof(int) * used);
+            memcpy(storage_vals(block, new_cap), A->vals, 
+                   (size_t)A->vbytes * used);
+        }
+        storage_swap(A, block, new_cap, A->vbytes);
     }
-    return -1;
 }
 
-// Get element value at (r,c)
-int csr_matrix_get(CSRMatrix_t *A, int r, int c) {
-    assert(r >= 0 && r < A->rows && c >= 0 && c < A->cols);
-    int idx = find_element_index(A, r, c);
-    return (idx != -1) ? A->vals[idx] : 0;
-}
+/* Stored values -------------------------------------------------------------*/
+// Values are stored as int8_t, int16_t or int, whichever is the narrowest
+// to hold the value bounds. A set that overflows the width widens all
+// values, and applying a transform widens to the bounds it leads to first
+// and narrows to them after. The kernels work on ints, so narrow values
+// are transformed by loops of their own, and converted to ints VAL_CHUNK
+// at a time where ints are needed.
 
-// Set element value at (r,c)
-void csr_matrix_set(CSRMatrix_t *A, int r, int c, int val) {
-    assert(r >= 0 && r < A->rows && c >= 0 && c < A->cols);
-    int idx = find_element_index(A, r, c);
-    
-    if (idx != -1) {
-        if (val == 0) {
-            // Remove element
-            for (int i = idx; i < A->nnz - 1; i++) {
-                A->vals[i] = A->vals[i + 1];
-                A->cidx[i] = A->cidx[i + 1];
-            }
-            A->nnz--;
-            
-            // Update row pointers
-            for (int i = r + 1; i <= A->rows; i++) {
-                A->rptr[i]--;
-            }
-        } else {
-            // Update existing element
-            A->vals[idx] = val;
-        }
-    } else if (val != 0) {
-        // Add new element
-        resize_if_needed(A);
-        
-        // Shift elements to make space
-        int insert_pos = A->rptr[r + 1];
-        for (int i = A->nnz; i > insert_pos; i--) {
-            A->vals[i] = A->vals[i - 1];
-            A->cidx[i] = A->cidx[i - 1];
-        }
-        
-        // Insert new element
-        A->vals[insert_pos] = val;
-        A->cidx[insert_pos] = c;
-        A->nnz++;
-        
-        // Update row pointers
-        for (int i = r + 1; i <= A->rows; i++) {
-            A->rptr[i]++;
-        }
+// Bytes needed to store every value from lo to hi; 1 if lo > hi
+int val_width(int lo, int hi) {
+    if (lo > hi || (lo >= INT8_MIN && hi <= INT8_MAX)) {
+        return 1;
+    }
+    if (lo >= INT16_MIN && hi <= INT16_MAX) {
+        return 2;
     }
+    return (int)sizeof(int);
 }
 
-// Check if two matrices are equal 
-int csr_matrix_equals(CSRMatrix_t *A, CSRMatrix_t *B) {
-    if (A->rows != B->rows || A->cols != B->cols) {
-        return 0;
-    }
-    
-    if (A->nnz != B->nnz) {
-        return 0;
-    }
-    
-    for (int i = 0; i < A->nnz; i++) {
-        int r = 0;
-        while (r < A->rows && A->rptr[r + 1] <= i) {
-            r++;
-        }
-        int c = A->cidx[i];
-        int valA = A->vals[i];
-        
-        int valB = csr_matrix_get(B, r, c);
-        
-        if (valA != valB) {
-            return 0;
-        }
-    }
-    
-    for (int i = 0; i < B->nnz; i++) {
-        int r = 0;
-        while (r < B->rows && B->rptr[r + 1] <= i) {
-            r++;
-        }
-        int c = B->cidx[i];
-        int valB = B->vals[i];
-        
-        int valA = csr_matrix_get(A, r, c);
-        
-        if (valA != valB) {
-            return 0;
-        }
-    }
-    
-    return 1;
+// Value i of an array of values w bytes wide
+int val_get(const char *vals, int w, long i) {
+    if (w == 1) return ((const int8_t*)vals)[i];
+    if (w == 2) return ((const int16_t*)vals)[i];
+    return ((const int*)vals)[i];
 }
 
-// Read matrix from input
-CSRMatrix_t* csr_matrix_read(int rows, int cols) {
-    CSRMatrix_t *A = csr_matrix_create(rows, cols);
-    char line[MAX_LINE_LEN];
-    
-    while (fgets(line, MAX_LINE_LEN, stdin)) {
-        line[strcspn(line, "\n")] = 0;
-        if (strlen(line) == 0) continue;
-        if (line[0] == '#') break;
-        
-        int r, c, val;
-        if (sscanf(line, "%d,%d,%d", &r, &c, &val) == 3) {
-            csr_matrix_set(A, r, c, val);
-        }
+// Store v, which must fit, as value i of an array of values w bytes wide
+void val_put(char *vals, int w, long i, int v) {
+    if (w == 1) {
+        assert(v >= INT8_MIN && v <= INT8_MAX);
+        ((int8_t*)vals)[i] = (int8_t)v;
+    } else if (w == 2) {
+        assert(v >= INT16_MIN && v <= INT16_MAX);
+        ((int16_t*)vals)[i] = (int16_t)v;
+    } else {
+        ((int*)vals)[i] = v;
     }
-    
-    return A;
 }
 
-// Check if matrix is small
-int is_small_matrix(CSRMatrix_t *A) {
-    if (A->rows > MAX_SMALL_DIM || A->cols > MAX_SMALL_DIM) return 0;
-    
-    for (int i = 0; i < A->nnz; i++) {
-        if (A->vals[i] < 0 || A->vals[i] > MAX_SMALL_VAL) return 0;
+// Widen n values w bytes wide into ints
+void vals_load(const char *src, int w, int *dst, int n) {
+    if (w == 1) {
+        for (int i = 0; i < n; i++) dst[i] = ((const int8_t*)src)[i];
+    } else if (w == 2) {
+        for (int i = 0; i < n; i++) dst[i] = ((const int16_t*)src)[i];
+    } else {
+        memmove(dst, src, sizeof(int) * (size_t)n);
     }
-    return 1;
 }
 
-// Print matrix
-void csr_matrix_print(CSRMatrix_t *A, char *title) {
-    printf("%s: %dx%d, nnz=%d\n", title, A->rows, A->cols, A->nnz);
-    
-    if (is_small_matrix(A)) {
-        // Print small matrix as grid
-        for (int r = 0; r < A->rows; r++) {
-            printf("[");
-            for (int c = 0; c < A->cols; c++) {
-                int val = csr_matrix_get(A, r, c);
-                printf("%c", val == 0 ? ' ' : '0' + val);
-            }
-            printf("]\n");
-        }
+// Narrow n ints, which must fit, into values w bytes wide
+void vals_store(const int *src, char *dst, int w, int n) {
+    if (w == 1) {
+        for (int i = 0; i < n; i++) ((int8_t*)dst)[i] = (int8_t)src[i];
+    } else if (w == 2) {
+        for (int i = 0; i < n; i++) ((int16_t*)dst)[i] = (int16_t)src[i];
     } else {
-        // Print large matrix as non-zero elements
-        for (int r = 0; r < A->rows; r++) {
-            for (int i = A->rptr[r]; i < A->rptr[r + 1]; i++) {
-                printf("(%d,%d)=%d\n", r, A->cidx[i], A->vals[i]);
-            }
-        }
+        memmove(dst, src, sizeof(int) * (size_t)n);
     }
 }
 
-// Copy matrix
-CSRMatrix_t* csr_matrix_copy(CSRMatrix_t *A) {
-    CSRMatrix_t *copy = csr_matrix_create(A->rows, A->cols);
-    
-    // Allocate memory for values and column indices
-    if (A->nnz > 0) {
-        copy->cap = A->cap;
-        copy->vals = (int*)malloc(sizeof(int) * copy->cap);
-        copy->cidx = (int*)malloc(sizeof(int) * copy->cap);
-        assert(copy->vals != NULL && copy->cidx != NULL);
-        
-        // Copy values and column indices
-        memcpy(copy->vals, A->vals, sizeof(int) * A->nnz);
-        memcpy(copy->cidx, A->cidx, sizeof(int) * A->nnz);
-        copy->nnz = A->nnz;
+// Copy n values sw bytes wide to n values dw bytes wide, which must fit
+void vals_convert(const char *src, int sw, char *dst, int dw, int n) {
+    if (sw == dw) {
+        memcpy(dst, src, (size_t)sw * n);
+        return;
+    }
+    int buf[VAL_CHUNK];
+    for (int i = 0; i < n; i += VAL_CHUNK) {
+        int len = (n - i < VAL_CHUNK) ? n - i : VAL_CHUNK;
+        vals_load(src + (size_t)sw * i, sw, buf, len);
+        vals_store(buf, dst + (size_t)dw * i, dw, len);
     }
-    
-    // Copy row pointers
-    memcpy(copy->rptr, A->rptr, sizeof(int) * (A->rows + 1));
-    
-    return copy;
 }
 
-/* Operations implementation -------------------------------------------------*/
+// Value of stored entry i of A, without the pending transform
+int entry_value(CSRMatrix_t *A, int i) {
+    return val_get(A->vals, A->vbytes, i);
+}
 
-void op_set(CSRMatrix_t *A, int r, int c, int val) {
-    csr_matrix_set(A, r, c, val);
+// Store v as entry i of A; v must fit the value width
+void entry_store(CSRMatrix_t *A, int i, int v) {
+    val_put(A->vals, A->vbytes, i, v);
 }
 
-void op_swap(CSRMatrix_t *A, int r1, int c1, int r2, int c2) {
-    int val1 = csr_matrix_get(A, r1, c1);
-    int val2 = csr_matrix_get(A, r2, c2);
-    csr_matrix_set(A, r1, c1, val2);
-    csr_matrix_set(A, r2, c2, val1);
+// Address of the value of stored entry i of A
+char* entry_vals(CSRMatrix_t *A, int i) {
+    return A->vals + (size_t)A->vbytes * i;
 }
 
-void op_multiply(CSRMatrix_t *A, int val) {
-    for (int i = 0; i < A->nnz; i++) {
-        A->vals[i] *= val;
-    }
+// Values of a storage block of capacity cap, which follow its indices
+char* storage_vals(char *block, int cap) {
+    return block + sizeof(int) * (size_t)cap;
 }
 
-void op_add(CSRMatrix_t *A, int val) {
-    int i = 0;
-    while (i < A->nnz) {
-        A->vals[i] += val;
-        if (A->vals[i] == 0) {
-            // Remove element that became zero
-            int r = 0;
-            while (r < A->rows && A->rptr[r + 1] <= i) r++;
-            
-            for (int j = i; j < A->nnz - 1; j++) {
-                A->vals[j] = A->vals[j + 1];
-                A->cidx[j] = A->cidx[j + 1];
-            }
-            A->nnz--;
-            
-            for (int j = r + 1; j <= A->rows; j++) {
-                A->rptr[j]--;
-            }
-        } else {
-            i++;
-        }
-    }
+// Give A the storage block of capacity cap and value width w, returning
+// its old block to the pool
+void storage_swap(CSRMatrix_t *A, char *block, int cap, int w) {
+    storage_release((char*)A->cidx, A->cap, A->vbytes);
+    A->cidx = (int*)block;
+    A->vals = storage_vals(block, cap);
+    A->cap = cap;
+    A->vbytes = w;
 }
 
-void op_copy_row(CSRMatrix_t *A, int r1, int r2) {
-    // Clear destination row
+// Store the values of A w bytes wide, which must hold all of them
+void csr_matrix_rewidth(CSRMatrix_t *A, int w) {
+    if (w == A->vbytes) {
+        return;
+    }
+    assert(A->snap == NULL);
+    if (A->cidx == NULL) {
+        A->vbytes = w;
+        return;
+    }
+    int cap = A->cap;
+    char *block = storage_alloc(&cap, w);
+    int used = (A->rend != NULL) ? A->rptr[A->nrs] : A->nnz;
+    memcpy(block, A->cidx, sizeof(int) * used);
+    vals_convert(A->vals, A->vbytes, storage_vals(block, cap), w, used);
+    storage_swap(A, block, cap, w);
+}
+
+// Check if n values aw bytes wide at a equal n values bw bytes wide at b
+int equal_vals(const char *a, int aw, const char *b, int bw, int n) {
+    if (aw == bw && aw == (int)sizeof(int)) {
+        return equal_ints((const int*)a, (const int*)b, n);
+    }
+    if (aw == bw) {
+        return n == 0 || memcmp(a, b, (size_t)aw * n) == 0;
+    }
+    int x[VAL_CHUNK], y[VAL_CHUNK];
+    for (int i = 0; i < n; i += VAL_CHUNK) {
+        int len = (n - i < VAL_CHUNK) ? n - i : VAL_CHUNK;
+        vals_load(a + (size_t)aw * i, aw, x, len);
+        vals_load(b + (size_t)bw * i, bw, y, len);
+        if (memcmp(x, y, sizeof(int) * len) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// kernels.affine over n values w bytes wide; returns the same zero flag.
+// Narrow results fit their width, so only their low bits are computed:
+// SSE2, part of x86-64, does so 8 or 16 values at a time in 16-bit lanes.
+int affine_width(char *vals, int w, int n, int scale, int offset) {
+    if (w == (int)sizeof(int)) {
+        return kernels.affine((int*)vals, n, scale, offset);
+    }
+    int i = 0, zero = 0;
+#ifdef HAVE_X86_SIMD
+    __m128i s = _mm_set1_epi16((short)scale), o = _mm_set1_epi16((short)offset);
+    __m128i none = _mm_setzero_si128(), low = _mm_set1_epi16(0xFF), z = none;
+    for (; w == 1 && i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((__m128i*)(vals + i));
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(
+            _mm_unpacklo_epi8(v, none), s), o);
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(
+            _mm_unpackhi_epi8(v, none), s), o);
+        v = _mm_packus_epi16(_mm_and_si128(lo, low), _mm_and_si128(hi, low));
+        _mm_storeu_si128((__m128i*)(vals + i), v);
+        z = _mm_or_si128(z, _mm_cmpeq_epi8(v, none));
+    }
+    for (; w == 2 && i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((__m128i*)(vals + 2 * i));
+        v = _mm_add_epi16(_mm_mullo_epi16(v, s), o);
+        _mm_storeu_si128((__m128i*)(vals + 2 * i), v);
+        z = _mm_or_si128(z, _mm_cmpeq_epi16(v, none));
+    }
+    zero = (_mm_movemask_epi8(z) != 0);
+#endif
+    unsigned us = (unsigned)scale, uo = (unsigned)offset;
+    if (w == 1) {
+        int8_t *v = (int8_t*)vals;
+        for (; i < n; i++) {
+            v[i] = (int8_t)((unsigned)v[i] * us + uo);
+            zero |= (v[i] == 0);
+        }
+    } else {
+        int16_t *v = (int16_t*)vals;
+        for (; i < n; i++) {
+            v[i] = (int16_t)((unsigned)v[i] * us + uo);
+            zero |= (v[i] == 0);
+        }
+    }
+    return zero;
+}
+
+// kernels.compact over n values w bytes wide, with the same aliasing rule.
+// Narrow values are transformed in place first, then the non-zero ones
+// are moved down.
+int compact_width(char *vals, int *cidx, int n, char *dvals, int *dcidx, 
+                  int w, int scale, int offset) {
+    if (w == (int)sizeof(int)) {
+        return kernels.compact((int*)vals, cidx, n, (int*)dvals, dcidx, 
+                               scale, offset);
+    }
+    if (!affine_width(vals, w, n, scale, offset)) {
+        memmove(dvals, vals, (size_t)w * n);
+        memmove(dcidx, cidx, sizeof(int) * n);
+        return n;
+    }
+    int m = 0;
+    if (w == 1) {
+        int8_t *v = (int8_t*)vals, *d = (int8_t*)dvals;
+        for (int i = 0; i < n; i++) {
+            d[m] = v[i];
+            dcidx[m] = cidx[i];
+            m += (v[i] != 0);
+        }
+    } else {
+        int16_t *v = (int16_t*)vals, *d = (int16_t*)dvals;
+        for (int i = 0; i < n; i++) {
+            d[m] = v[i];
+            dcidx[m] = cidx[i];
+            m += (v[i] != 0);
+        }
+    }
+    return m;
+}
+
+/* Row storage ---------------------------------------------------------------*/
+// In CSR mode every physical row p has slot p. In DCSR mode only non-empty
+// rows have slots, with row ids in rid sorted ascending. Slot k covers
+// entries rptr[k] to rptr[k+1]-1 in both modes.
+// Either mode can also be gapped: every slot then keeps spare room after
+// its entries, which end at rend[k], so that inserting into or deleting
+// from a row moves only that row. When a slot runs out of room it borrows
+// from a neighbour's gap, and failing that all rows are respaced with
+// slack in proportion to their length, which amortizes row growth. Bulk
+// passes that rewrite every row pack the rows again.
+
+// Physical row stored in slot k
+int slot_row(CSRMatrix_t *A, int k) {
+    return (A->rid != NULL) ? A->rid[k] : k;
+}
+
+// First slot whose physical row is not below p
+int row_lower_slot(CSRMatrix_t *A, int p) {
+    if (A->rid == NULL) {
+        return p;
+    }
+    int lo = 0, hi = A->nrs;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (A->rid[mid] < p) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Slot of physical row p, or -1 if the row is empty and has no slot
+int row_slot(CSRMatrix_t *A, int p) {
+    int k = row_lower_slot(A, p);
+    return (k < A->nrs && slot_row(A, k) == p) ? k : -1;
+}
+
+// Entry range [lo,hi) of physical row p; empty at its insert position if
+// the row has no slot
+void row_bounds(CSRMatrix_t *A, int p, int *lo, int *hi) {
+    int k = row_lower_slot(A, p);
+    *lo = A->rptr[k];
+    *hi = (k < A->nrs && slot_row(A, k) == p) ? row_end(A, k) : *lo;
+}
+
+// End of the entries in slot k
+int row_end(CSRMatrix_t *A, int k) {
+    return (A->rend != NULL) ? A->rend[k] : A->rptr[k + 1];
+}
+
+// Shift the row pointers of all slots after slot k by delta entries
+void shift_rptr(CSRMatrix_t *A, int k, int delta) {
+    PROF_SHIFT(A->nrs - k);
+    for (int j = k + 1; j <= A->nrs; j++) {
+        A->rptr[j] += delta;
+    }
+}
+
+// Get the slot of physical row p, adding an empty slot if it has none.
+// Falls back to CSR mode once non-empty rows stop being a small fraction.
+int row_open(CSRMatrix_t *A, int p) {
+    int k = row_lower_slot(A, p);
+    if (A->rid == NULL || (k < A->nrs && A->rid[k] == p)) {
+        return k;
+    }
+    if ((A->nrs + 1) * (HYPERSPARSE_RATIO / 2) > A->rows) {
+        csr_matrix_to_csr(A);
+        return p;
+    }
+    if (A->nrs + 1 >= A->rcap) {
+        A->rcap *= GROWTH_FACTOR;
+        A->rid = (int*)mem_realloc(A->rid, sizeof(int) * A->rcap);
+        A->rptr = (int*)mem_realloc(A->rptr, sizeof(int) * A->rcap);
+        assert(A->rid != NULL && A->rptr != NULL);
+        if (A->rend != NULL) {
+            A->rend = (int*)mem_realloc(A->rend, sizeof(int) * A->rcap);
+        }
+    }
+    PROF_SHIFT(A->nrs - k);
+    memmove(A->rid + k + 1, A->rid + k, sizeof(int) * (A->nrs - k));
+    memmove(A->rptr + k + 1, A->rptr + k, sizeof(int) * (A->nrs - k + 1));
+    if (A->rend != NULL) {
+        // The new slot takes over the gap after the previous slot
+        memmove(A->rend + k + 1, A->rend + k, sizeof(int) * (A->nrs - k));
+        if (k > 0) A->rptr[k] = A->rend[k - 1];
+        A->rend[k] = A->rptr[k];
+    }
+    A->rid[k] = p;
+    A->nrs++;
+    return k;
+}
+
+// Remove slot k if its row became empty; DCSR mode only stores non-empty
+// rows, which keeps its arrays canonical
+void row_close(CSRMatrix_t *A, int k) {
+    if (A->rid == NULL || A->rptr[k] != row_end(A, k)) {
+        return;
+    }
+    PROF_SHIFT(A->nrs - k - 1);
+    memmove(A->rid + k, A->rid + k + 1, sizeof(int) * (A->nrs - k - 1));
+    memmove(A->rptr + k, A->rptr + k + 1, sizeof(int) * (A->nrs - k));
+    if (A->rend != NULL) {
+        // The slot's room joins the gap of the slot before it
+        memmove(A->rend + k, A->rend + k + 1, sizeof(int) * (A->nrs - k - 1));
+    }
+    A->nrs--;
+}
+
+// Decide whether an edit that would shift tail entries in packed rows
+// should use gapped rows instead, switching layout if so
+int row_use_gaps(CSRMatrix_t *A, int tail) {
+    if (A->rend == NULL && tail > GAPPED_MIN_SHIFT) {
+        csr_matrix_spread(A, -1, 0);
+    }
+    return A->rend != NULL;
+}
+
+// Make slot k of a gapped matrix able to hold need entries, borrowing from
+// the gap after it or before it, or respacing all rows
+void row_make_room(CSRMatrix_t *A, int k, int need) {
+    assert(A->snap == NULL);
+    int short_by = need - (A->rptr[k + 1] - A->rptr[k]);
+    if (short_by <= 0) {
+        return;
+    }
+    if (k + 1 == A->nrs && A->cap - A->rptr[k + 1] >= short_by) {
+        // Last slot: extend into the free space at the end of storage
+        A->rptr[k + 1] += short_by;
+    } else if (k + 1 < A->nrs 
+               && A->rptr[k + 2] - A->rend[k + 1] >= short_by) {
+        // Move the next row up into its own gap
+        int lo = A->rptr[k + 1], len = A->rend[k + 1] - lo;
+        PROF_SHIFT(len);
+        memmove(entry_vals(A, lo + short_by), entry_vals(A, lo), 
+                (size_t)A->vbytes * len);
+        memmove(A->cidx + lo + short_by, A->cidx + lo, sizeof(int) * len);
+        A->rptr[k + 1] += short_by;
+        A->rend[k + 1] += short_by;
+    } else if ((k == 0) ? A->rptr[0] >= short_by 
+                        : A->rptr[k] - A->rend[k - 1] >= short_by) {
+        // Move this row down into the gap before it
+        int lo = A->rptr[k], len = A->rend[k] - lo;
+        PROF_SHIFT(len);
+        memmove(entry_vals(A, lo - short_by), entry_vals(A, lo), 
+                (size_t)A->vbytes * len);
+        memmove(A->cidx + lo - short_by, A->cidx + lo, sizeof(int) * len);
+        A->rptr[k] -= short_by;
+        A->rend[k] -= short_by;
+    } else {
+        csr_matrix_spread(A, k, need);
+    }
+}
+
+// Respace all rows into a fresh block with slack in proportion to their
+// length, giving slot k (if not -1) room for at least need entries
+void csr_matrix_spread(CSRMatrix_t *A, int k, int need) {
+    PROF_BEGIN(PROF_SPREAD);
+    long total = 0;
+    for (int j = 0; j < A->nrs; j++) {
+        int len = row_end(A, j) - A->rptr[j];
+        if (j == k && len < need) len = need;
+        total += len + len / 2 + GAP_MIN_SLACK;
+    }
+    assert(total <= INT_MAX / 2);
+    int cap = (int)total, w = A->vbytes;
+    char *block = storage_alloc(&cap, w);
+    int *cidx = (int*)block;
+    char *vals = storage_vals(block, cap);
+    int *rend = (int*)mem_alloc(sizeof(int) * A->rcap);
+    int n = 0;
+    for (int j = 0; j < A->nrs; j++) {
+        int lo = A->rptr[j], len = row_end(A, j) - lo;
+        int room = (j == k && len < need) ? need : len;
+        memcpy(vals + (size_t)w * n, entry_vals(A, lo), (size_t)w * len);
+        memcpy(cidx + n, A->cidx + lo, sizeof(int) * len);
+        A->rptr[j] = n;
+        rend[j] = n + len;
+        n += room + room / 2 + GAP_MIN_SLACK;
+    }
+    A->rptr[A->nrs] = n;
+    storage_swap(A, block, cap, w);
+    mem_free(A->rend);
+    A->rend = rend;
+    PROF_END(PROF_SPREAD);
+}
+
+// Pack gapped rows back together in place
+void csr_matrix_pack(CSRMatrix_t *A) {
+    if (A->rend == NULL) {
+        return;
+    }
+    PROF_BEGIN(PROF_PACK);
+    csr_matrix_will_write(A);
+    int n = 0;
+    for (int k = 0; k < A->nrs; k++) {
+        int lo = A->rptr[k], len = A->rend[k] - lo;
+        PROF_SHIFT(len);
+        memmove(entry_vals(A, n), entry_vals(A, lo), (size_t)A->vbytes * len);
+        memmove(A->cidx + n, A->cidx + lo, sizeof(int) * len);
+        A->rptr[k] = n;
+        n += len;
+    }
+    A->rptr[A->nrs] = n;
+    mem_free(A->rend);
+    A->rend = NULL;
+    PROF_END(PROF_PACK);
+}
+
+// Switch to CSR mode, with one row pointer per row
+void csr_matrix_to_csr(CSRMatrix_t *A) {
+    if (A->rid == NULL) {
+        return;
+    }
+    PROF_BEGIN(PROF_RELAYOUT);
+    csr_matrix_will_write(A);
+    csr_matrix_pack(A);
+    int *rptr = (int*)mem_alloc(sizeof(int) * (A->rows + 1));
+    assert(rptr != NULL);
+    int k = 0;
+    for (int p = 0; p <= A->rows; p++) {
+        while (k < A->nrs && A->rid[k] < p) {
+            k++;
+        }
+        rptr[p] = A->rptr[k];
+    }
+    mem_free(A->rid);
+    mem_free(A->rptr);
+    A->rid = NULL;
+    A->rptr = rptr;
+    A->nrs = A->rows;
+    A->rcap = A->rows + 1;
+    PROF_END(PROF_RELAYOUT);
+}
+
+// Switch to DCSR mode, keeping only the non-empty rows
+void csr_matrix_to_dcsr(CSRMatrix_t *A) {
+    if (A->rid != NULL) {
+        return;
+    }
+    PROF_BEGIN(PROF_RELAYOUT);
+    csr_matrix_will_write(A);
+    csr_matrix_pack(A);
+    int n = 0;
+    for (int p = 0; p < A->rows; p++) {
+        n += (A->rptr[p] != A->rptr[p + 1]);
+    }
+    A->rcap = n + 1;
+    A->rid = (int*)mem_alloc(sizeof(int) * A->rcap);
+    assert(A->rid != NULL);
+    int k = 0;
+    for (int p = 0; p < A->rows; p++) {
+        if (A->rptr[p] != A->rptr[p + 1]) {
+            A->rid[k] = p;
+            A->rptr[k] = A->rptr[p];
+            k++;
+        }
+    }
+    A->rptr[k] = A->nnz;
+    A->rptr = (int*)mem_realloc(A->rptr, sizeof(int) * A->rcap);
+    assert(A->rptr != NULL);
+    A->nrs = n;
+    PROF_END(PROF_RELAYOUT);
+}
+
+// Use DCSR mode when few rows are non-empty, and CSR mode otherwise
+void csr_matrix_pick_layout(CSRMatrix_t *A) {
+    int nonempty = 0;
+    for (int k = 0; k < A->nrs; k++) {
+        nonempty += (A->rptr[k] != A->rptr[k + 1]);
+    }
+    if (nonempty * HYPERSPARSE_RATIO <= A->rows) {
+        csr_matrix_to_dcsr(A);
+    } else {
+        csr_matrix_to_csr(A);
+    }
+}
+
+// Find index of the first element in row r with column index >= c;
+// column indices are kept sorted within each row, so binary search
+int find_insert_index(CSRMatrix_t *A, int r, int c) {
+    int lo, hi;
+    row_bounds(A, r, &lo, &hi);
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (A->cidx[mid] < c) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Find index of element at (r,c) in CSR matrix
+int find_element_index(CSRMatrix_t *A, int r, int c) {
+    int lo, hi;
+    row_bounds(A, r, &lo, &hi);
+    int idx = find_insert_index(A, r, c);
+    if (idx < hi && A->cidx[idx] == c) {
+        return idx;
+    }
+    return -1;
+}
+
+#ifdef CSR_DEBUG
+// Check CSR invariants: monotone row pointers and strictly increasing,
+// in-range column indices within every row
+int csr_matrix_check(CSRMatrix_t *A) {
+    if ((A->rend == NULL) ? (A->rptr[0] != 0 || A->rptr[A->nrs] != A->nnz)
+                          : (A->rptr[0] < 0 || A->rptr[A->nrs] > A->cap)) {
+        return 0;
+    }
+    if (A->nnz > A->cap || (A->rid == NULL && A->nrs != A->rows)) {
+        return 0;
+    }
+    if (A->vbytes != 1 && A->vbytes != 2 && A->vbytes != (int)sizeof(int)) {
+        return 0;
+    }
+    int count = 0;
+    for (int k = 0; k < A->nrs; k++) {
+        int end = row_end(A, k);
+        if (A->rptr[k] > end || end > A->rptr[k + 1]) {
+            return 0;
+        }
+        count += end - A->rptr[k];
+        // DCSR mode stores only non-empty rows, in ascending order
+        if (A->rid != NULL && (A->rid[k] < 0 || A->rid[k] >= A->rows 
+                || (k > 0 && A->rid[k - 1] >= A->rid[k]) 
+                || A->rptr[k] == end)) {
+            return 0;
+        }
+        for (int i = A->rptr[k]; i < end; i++) {
+            if (A->cidx[i] < 0 || A->cidx[i] >= A->cols) {
+                return 0;
+            }
+            if (i > A->rptr[k] && A->cidx[i - 1] >= A->cidx[i]) {
+                return 0;
+            }
+            int v = transformed_value(A, entry_value(A, i));
+            if (v < A->vlo || v > A->vhi) {
+                return 0;
+            }
+        }
+    }
+    if (count != A->nnz) {
+        return 0;
+    }
+    // The column index must list exactly the stored entries
+    if (A->csc != NULL) {
+        count = 0;
+        for (int c = 0; c < A->cols; c++) {
+            for (int j = 0; j < A->csc->len[c]; j++) {
+                if (find_element_index(A, A->csc->rows[c][j], c) == -1) {
+                    return 0;
+                }
+            }
+            count += A->csc->len[c];
+        }
+        if (count != A->nnz) {
+            return 0;
+        }
+    }
+    // Row and column maps must be inverses of each other
+    if ((A->rperm == NULL) != (A->rinv == NULL) 
+            || (A->cperm == NULL) != (A->cinv == NULL)) {
+        return 0;
+    }
+    for (int r = 0; A->rperm != NULL && r < A->rows; r++) {
+        if (A->rinv[A->rperm[r]] != r) {
+            return 0;
+        }
+    }
+    for (int c = 0; A->cperm != NULL && c < A->cols; c++) {
+        if (A->cinv[A->cperm[c]] != c) {
+            return 0;
+        }
+    }
+    // An up-to-date hash must match one computed from scratch, which is
+    // only compared, so the incremental hash carries on as it was
+    if (A->hashed) {
+        unsigned long long sum = 0;
+        for (int k = 0; k < A->nrs; k++) {
+            int p = slot_row(A, k);
+            sum += row_hash(A, p, (A->rinv != NULL) ? A->rinv[p] : p);
+        }
+        if (sum != A->hash) {
+            return 0;
+        }
+    }
+    return 1;
+}
+#endif
+
+// Allocate an identity mapping over n indices
+int* identity_map(int n) {
+    int *map = (int*)mem_alloc(sizeof(int) * (n > 0 ? n : 1));
+    assert(map != NULL);
+    for (int i = 0; i < n; i++) {
+        map[i] = i;
+    }
+    return map;
+}
+
+// Compare two 64-bit sort keys, for qsort
+int compare_keys(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long*)a;
+    unsigned long long y = *(const unsigned long long*)b;
+    return (x > y) - (x < y);
+}
+
+// Sort the entries in [lo,hi) by column index after column relabeling;
+// insertion sort, as a few column swaps leave rows nearly sorted
+void sort_row_segment(CSRMatrix_t *A, int lo, int hi) {
+    for (int i = lo + 1; i < hi; i++) {
+        int c = A->cidx[i], v = entry_value(A, i);
+        int j = i - 1;
+        while (j >= lo && A->cidx[j] > c) {
+            A->cidx[j + 1] = A->cidx[j];
+            entry_store(A, j + 1, entry_value(A, j));
+            j--;
+        }
+        A->cidx[j + 1] = c;
+        entry_store(A, j + 1, v);
+    }
+}
+
+// Apply the pending row and column permutations to the physical layout, so
+// that rows and column indices are stored in logical order again
+void csr_matrix_materialize(CSRMatrix_t *A) {
+    if (A->cperm == NULL && A->rperm == NULL) {
+        return;
+    }
+    PROF_BEGIN(PROF_MATERIALIZE);
+    // The column index lists physical rows of physical columns
+    csr_matrix_drop_index(A);
+    csr_matrix_will_write(A);
+    if (A->cperm != NULL) {
+        // Relabel column indices, then restore sorted order within rows
+        for (int k = 0; k < A->nrs; k++) {
+            int end = row_end(A, k);
+            for (int i = A->rptr[k]; i < end; i++) {
+                A->cidx[i] = A->cinv[A->cidx[i]];
+            }
+            sort_row_segment(A, A->rptr[k], end);
+        }
+        mem_free(A->cperm);
+        mem_free(A->cinv);
+        A->cperm = NULL;
+        A->cinv = NULL;
+    }
+    if (A->rperm != NULL) {
+        // Order the slots by the logical row they hold
+        long mark = scratch_mark();
+        scratch_reserve(sizeof(unsigned long long) * A->nrs 
+                        + sizeof(int) * A->rcap + 2 * SCRATCH_ALIGN);
+        unsigned long long *keys = (unsigned long long*)scratch_alloc(
+            sizeof(unsigned long long) * A->nrs);
+        if (A->rid != NULL) {
+            for (int k = 0; k < A->nrs; k++) {
+                keys[k] = ((unsigned long long)A->rinv[A->rid[k]] << 32) 
+                        | (unsigned)k;
+            }
+            qsort(keys, A->nrs, sizeof(unsigned long long), compare_keys);
+        } else {
+            for (int r = 0; r < A->rows; r++) {
+                keys[r] = ((unsigned long long)r << 32) 
+                        | (unsigned)A->rperm[r];
+            }
+        }
+        
+        // Gather the slots in logical order into a fresh block, packed
+        int cap = A->cap, w = A->vbytes;
+        char *block = storage_alloc(&cap, w);
+        int *cidx = (int*)block;
+        char *vals = storage_vals(block, cap);
+        int *rptr = (int*)scratch_alloc(sizeof(int) * A->rcap);
+        int n = 0;
+        for (int j = 0; j < A->nrs; j++) {
+            int k = (int)(keys[j] & 0xFFFFFFFFULL);
+            int len = row_end(A, k) - A->rptr[k];
+            rptr[j] = n;
+            memcpy(vals + (size_t)w * n, entry_vals(A, A->rptr[k]), 
+                   (size_t)w * len);
+            memcpy(cidx + n, A->cidx + A->rptr[k], sizeof(int) * len);
+            n += len;
+            if (A->rid != NULL) {
+                A->rid[j] = (int)(keys[j] >> 32);
+            }
+        }
+        rptr[A->nrs] = n;
+        memcpy(A->rptr, rptr, sizeof(int) * (A->nrs + 1));
+        scratch_release(mark);
+        storage_swap(A, block, cap, w);
+        mem_free(A->rend);
+        mem_free(A->rperm);
+        mem_free(A->rinv);
+        A->rend = NULL;
+        A->rperm = NULL;
+        A->rinv = NULL;
+    }
+    PROF_END(PROF_MATERIALIZE);
+}
+
+// Value of stored element v under the pending transform, in wrapping
+// arithmetic so that composed multiplies match step-by-step ones
+int transformed_value(CSRMatrix_t *A, int v) {
+    return (int)((unsigned)v * (unsigned)A->scale + (unsigned)A->offset);
+}
+
+// Apply the pending value transform in a single pass, compacting away the
+// entries it maps to zero when it includes an add. Gapped rows are
+// compacted in place, keeping their room. The per-entry work runs in the
+// vector kernels; without an add, packed rows take one call over all
+// entries, as no row can empty. Large packed matrices are split over the
+// thread pool. Values are widened beforehand to hold the new bounds and
+// narrowed afterwards if those bounds allow.
+void csr_matrix_apply(CSRMatrix_t *A) {
+    if (A->scale == 1 && A->offset == 0 && !A->drop) {
+        return;
+    }
+    PROF_BEGIN(PROF_APPLY);
+    csr_matrix_will_write(A);
+    int w = val_width(A->vlo, A->vhi);
+    if (w > A->vbytes) {
+        csr_matrix_rewidth(A, w);
+    }
+    int bounds[PAR_MAX_CHUNKS + 1];
+    int nchunks = (A->rend == NULL) ? par_chunks(A, bounds) : 1;
+    if (nchunks > 1) {
+        csr_matrix_apply_par(A, bounds, nchunks);
+    } else if (!A->drop && A->rend == NULL) {
+        A->zeros = affine_width(A->vals, A->vbytes, A->nnz, 
+                                A->scale, A->offset);
+        A->scale = 1;
+        A->offset = 0;
+    } else {
+        apply_rows(A);
+    }
+    if (w < A->vbytes) {
+        csr_matrix_rewidth(A, w);
+    }
+    PROF_END(PROF_APPLY);
+}
+
+// Apply the pending transform of A one row at a time
+void apply_rows(CSRMatrix_t *A) {
+    int n = 0, m = 0, nnz = 0, zeros = 0, dropped = 0;
+    int extent = A->rptr[A->nrs];
+    for (int k = 0; k < A->nrs; k++) {
+        int start = A->rptr[k], end = row_end(A, k);
+        int row = slot_row(A, k);
+        if (A->rend != NULL) n = start;
+        A->rptr[m] = n;
+        if (A->drop) {
+            n += compact_width(entry_vals(A, start), A->cidx + start, 
+                               end - start, entry_vals(A, n), A->cidx + n, 
+                               A->vbytes, A->scale, A->offset);
+            dropped |= (n - A->rptr[m] != end - start);
+        } else {
+            zeros |= affine_width(entry_vals(A, start), A->vbytes, 
+                                  end - start, A->scale, A->offset);
+            n += end - start;
+        }
+        nnz += n - A->rptr[m];
+        // DCSR mode drops slots whose row became empty
+        if (A->rid == NULL || A->rptr[m] != n) {
+            if (A->rid != NULL) A->rid[m] = row;
+            if (A->rend != NULL) A->rend[m] = n;
+            m++;
+        }
+    }
+    A->nrs = m;
+    A->rptr[m] = (A->rend != NULL) ? extent : n;
+    A->nnz = nnz;
+    A->zeros = zeros;
+    if (dropped) {
+        csr_matrix_drop_index(A);
+    }
+    A->scale = 1;
+    A->offset = 0;
+    A->drop = 0;
+}
+
+// Hash of a single non-zero cell (r,c)=val; cell hashes are summed, so the
+// matrix hash can be updated incrementally in any order
+unsigned long long cell_hash(int r, int c, int val) {
+    unsigned long long x = ((unsigned long long)(unsigned)r << 32) 
+                         | (unsigned)c;
+    x ^= (unsigned long long)(unsigned)val * 0x9E3779B97F4A7C15ULL;
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// Sum of the cell hashes of physical row p, taken as logical row r
+unsigned long long row_hash(CSRMatrix_t *A, int p, int r) {
+    unsigned long long sum = 0;
+    int lo, hi;
+    row_bounds(A, p, &lo, &hi);
+    for (int i = lo; i < hi; i++) {
+        int val = transformed_value(A, entry_value(A, i));
+        if (val != 0) {
+            int c = (A->cinv != NULL) ? A->cinv[A->cidx[i]] : A->cidx[i];
+            sum += cell_hash(r, c, val);
+        }
+    }
+    return sum;
+}
+
+// Add (sign 1) or remove (sign -1) the cells of physical row p, taken as
+// logical row r, to or from the matrix hash
+void hash_row(CSRMatrix_t *A, int p, int r, int sign) {
+    A->hash += (unsigned long long)sign * row_hash(A, p, r);
+}
+
+// Move the cells of physical column q from logical column c to logical
+// column to in the matrix hash, visiting only the rows the column index
+// lists for q
+void hash_col(CSRMatrix_t *A, int q, int c, int to) {
+    ColIndex_t *x = A->csc;
+    for (int j = 0; j < x->len[q]; j++) {
+        int p = x->rows[q][j];
+        int i = find_element_index(A, p, q);
+        int val = transformed_value(A, entry_value(A, i));
+        if (val != 0) {
+            int r = (A->rinv != NULL) ? A->rinv[p] : p;
+            A->hash += cell_hash(r, to, val) - cell_hash(r, c, val);
+        }
+    }
+}
+
+// Get matrix hash, recomputing it if an operation invalidated it
+unsigned long long csr_matrix_hash(CSRMatrix_t *A) {
+    if (!A->hashed) {
+        PROF_BEGIN(PROF_HASH);
+        // Cell hashes are summed, so chunks of rows hash independently
+        int bounds[PAR_MAX_CHUNKS + 1];
+        unsigned long long sums[PAR_MAX_CHUNKS];
+        ParApply_t w;
+        w.A = A;
+        w.bounds = bounds;
+        w.sums = sums;
+        w.n = par_chunks(A, bounds);
+        par_run(w.n, par_hash, &w);
+        A->hash = 0;
+        for (int j = 0; j < w.n; j++) {
+            A->hash += sums[j];
+        }
+        A->hashed = 1;
+        PROF_END(PROF_HASH);
+    }
+    return A->hash;
+}
+
+// Get element value at (r,c)
+int csr_matrix_get(CSRMatrix_t *A, int r, int c) {
+    assert(r >= 0 && r < A->rows && c >= 0 && c < A->cols);
+    if (A->rperm != NULL) r = A->rperm[r];
+    if (A->cperm != NULL) c = A->cperm[c];
+    int idx = find_element_index(A, r, c);
+    return (idx != -1) ? transformed_value(A, entry_value(A, idx)) : 0;
+}
+
+// Set element value at (r,c)
+void csr_matrix_set(CSRMatrix_t *A, int r, int c, int val) {
+    assert(r >= 0 && r < A->rows && c >= 0 && c < A->cols);
+    int lr = r, lc = c;
+    if (A->rperm != NULL) r = A->rperm[r];
+    if (A->cperm != NULL) c = A->cperm[c];
+    csr_matrix_apply(A);
+    int idx = find_element_index(A, r, c);
+    if (idx != -1 || val != 0) {
+        csr_matrix_will_write(A);
+    }
+    if (val != 0) {
+        value_bound(A, val);
+        if (val_width(val, val) > A->vbytes) {
+            csr_matrix_rewidth(A, val_width(val, val));
+        }
+    }
+    
+    // Replace the cell's contribution to the matrix hash
+    if (A->hashed) {
+        if (idx != -1 && entry_value(A, idx) != 0) {
+            A->hash -= cell_hash(lr, lc, entry_value(A, idx));
+        }
+        if (val != 0) {
+            A->hash += cell_hash(lr, lc, val);
+        }
+    }
+    
+    if (idx != -1) {
+        if (val == 0) {
+            entry_remove(A, r, idx);
+        } else {
+            // Update existing element
+            entry_store(A, idx, val);
+        }
+    } else if (val != 0) {
+        entry_insert(A, r, c, val);
+    }
+}
+
+// Store val at physical cell (p,c), which holds no entry yet, keeping the
+// row sorted
+void entry_insert(CSRMatrix_t *A, int p, int c, int val) {
+    assert(A->snap == NULL);
+    int k = row_open(A, p);
+    int insert_pos = find_insert_index(A, p, c);
+    if (A->csc != NULL) {
+        col_index_add(A->csc, c, p);
+    }
+    if (row_use_gaps(A, A->nnz - insert_pos)) {
+        // Add new element within the row's room
+        row_make_room(A, k, A->rend[k] - A->rptr[k] + 1);
+        insert_pos = find_insert_index(A, p, c);
+        PROF_SHIFT(A->rend[k] - insert_pos);
+        memmove(entry_vals(A, insert_pos + 1), entry_vals(A, insert_pos), 
+                (size_t)A->vbytes * (A->rend[k] - insert_pos));
+        memmove(A->cidx + insert_pos + 1, A->cidx + insert_pos, 
+                sizeof(int) * (A->rend[k] - insert_pos));
+        entry_store(A, insert_pos, val);
+        A->cidx[insert_pos] = c;
+        A->rend[k]++;
+        A->nnz++;
+        return;
+    }
+    // Add new element
+    resize_if_needed(A);
+    
+    // Shift elements to make space, keeping the row sorted
+    PROF_SHIFT(A->nnz - insert_pos);
+    memmove(entry_vals(A, insert_pos + 1), entry_vals(A, insert_pos), 
+            (size_t)A->vbytes * (A->nnz - insert_pos));
+    memmove(A->cidx + insert_pos + 1, A->cidx + insert_pos, 
+            sizeof(int) * (A->nnz - insert_pos));
+    
+    // Insert new element
+    entry_store(A, insert_pos, val);
+    A->cidx[insert_pos] = c;
+    A->nnz++;
+    
+    // Update row pointers
+    shift_rptr(A, k, 1);
+}
+
+// Remove the stored entry at index idx, which lies in physical row p
+void entry_remove(CSRMatrix_t *A, int p, int idx) {
+    assert(A->snap == NULL);
+    int k = row_slot(A, p);
+    int c = A->cidx[idx];
+    if (A->csc != NULL) {
+        col_index_remove(A->csc, c, p);
+    }
+    if (row_use_gaps(A, A->nnz - idx - 1)) {
+        // Remove element from within its row
+        idx = find_element_index(A, p, c);
+        PROF_SHIFT(A->rend[k] - idx - 1);
+        memmove(entry_vals(A, idx), entry_vals(A, idx + 1), 
+                (size_t)A->vbytes * (A->rend[k] - idx - 1));
+        memmove(A->cidx + idx, A->cidx + idx + 1, 
+                sizeof(int) * (A->rend[k] - idx - 1));
+        A->rend[k]--;
+        A->nnz--;
+        row_close(A, k);
+        return;
+    }
+    // Remove element
+    PROF_SHIFT(A->nnz - idx - 1);
+    memmove(entry_vals(A, idx), entry_vals(A, idx + 1), 
+            (size_t)A->vbytes * (A->nnz - idx - 1));
+    memmove(A->cidx + idx, A->cidx + idx + 1, 
+            sizeof(int) * (A->nnz - idx - 1));
+    A->nnz--;
+    
+    // Update row pointers
+    shift_rptr(A, k, -1);
+    row_close(A, k);
+}
+
+// Check if every stored element of A has the same value in B, visiting A's
+// rows and columns through its logical maps; A's transform must be applied
+int csr_matrix_contains(CSRMatrix_t *A, CSRMatrix_t *B) {
+    for (int k = 0; k < A->nrs; k++) {
+        int p = slot_row(A, k);
+        int r = (A->rinv != NULL) ? A->rinv[p] : p;
+        for (int i = A->rptr[k]; i < row_end(A, k); i++) {
+            int c = (A->cinv != NULL) ? A->cinv[A->cidx[i]] : A->cidx[i];
+            if (entry_value(A, i) != csr_matrix_get(B, r, c)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// Check if two matrices are equal. Differing hashes settle the common case
+// in O(1); otherwise the canonical arrays are compared directly.
+int csr_matrix_equals(CSRMatrix_t *A, CSRMatrix_t *B) {
+    if (A->rows != B->rows || A->cols != B->cols) {
+        return 0;
+    }
+    
+    if (csr_matrix_hash(A) != csr_matrix_hash(B)) {
+        return 0;
+    }
+    
+    csr_matrix_apply(A);
+    csr_matrix_apply(B);
+    if (A->nnz != B->nnz) {
+        return 0;
+    }
+    
+    // Stored zeros can sit at different cells of equal matrices, and the
+    // arrays are only canonical within one row mode
+    if (A->zeros || B->zeros || (A->rid == NULL) != (B->rid == NULL)) {
+        return csr_matrix_contains(A, B) && csr_matrix_contains(B, A);
+    }
+    csr_matrix_materialize(A);
+    csr_matrix_materialize(B);
+    csr_matrix_pack(A);
+    csr_matrix_pack(B);
+    return A->nrs == B->nrs
+        && (A->rid == NULL || equal_ints(A->rid, B->rid, A->nrs))
+        && equal_ints(A->rptr, B->rptr, A->nrs + 1)
+        && equal_ints(A->cidx, B->cidx, A->nnz)
+        && equal_vals(A->vals, A->vbytes, B->vals, B->vbytes, A->nnz);
+}
+
+// Read the matrix dimensions line, in MTXDIM format
+void read_dims(Reader_t *in, int *rows, int *cols) {
+    int len;
+    char *line = reader_line(in, &len);
+    const char *dim = (line != NULL) ? scan_int(line, line + len, rows) : NULL;
+    if (dim != NULL && dim < line + len && *dim == 'x') {
+        dim = scan_int(dim + 1, line + len, cols);
+    } else {
+        dim = NULL;
+    }
+    assert(dim != NULL);
+}
+
+// Read matrix from input, buffering the triplets before a single bulk build.
+// A section whose first line is SNAP_PREFIX and a path holds nothing else,
+// and gives the matrix stored in that snapshot file instead.
+CSRMatrix_t* csr_matrix_read(Reader_t *in, int rows, int cols) {
+    PROF_BEGIN(PROF_READ);
+    char *line;
+    int len, n = 0, cap = INITIAL_CAPACITY;
+    int *ri = NULL, *ci = NULL, *vi = NULL;
+    CSRMatrix_t *snap = NULL;
+    
+    while ((line = reader_line(in, &len)) != NULL) {
+        if (len == 0) continue;
+        if (line[0] == '#') break;
+        
+        if (line[0] == SNAP_PREFIX && n == 0 && snap == NULL) {
+            snap = snap_line_load(line, len, rows, cols);
+            continue;
+        }
+        assert(snap == NULL);
+        int rcv[3];
+        if (scan_ints(line, line + len, rcv, 3) == 3) {
+            int r = rcv[0], c = rcv[1], val = rcv[2];
+            assert(r >= 0 && r < rows && c >= 0 && c < cols);
+            if (n >= cap) {
+                cap = (cap == 0) ? 1 : cap * GROWTH_FACTOR;
+                ri = (int*)mem_realloc(ri, sizeof(int) * cap);
+                ci = (int*)mem_realloc(ci, sizeof(int) * cap);
+                vi = (int*)mem_realloc(vi, sizeof(int) * cap);
+                assert(ri != NULL && ci != NULL && vi != NULL);
+            }
+            ri[n] = r;
+            ci[n] = c;
+            vi[n] = val;
+            n++;
+        }
+    }
+    if (snap != NULL) {
+        PROF_END(PROF_READ);
+        return snap;
+    }
+    
+    CSRMatrix_t *A = csr_matrix_build(rows, cols, n, ri, ci, vi);
+    mem_free(ri);
+    mem_free(ci);
+    mem_free(vi);
+    PROF_END(PROF_READ);
+    return A;
+}
+
+// Build CSR matrix from n (row, col, val) triplets given in input order.
+// Triplets are sorted by (row, col) with two stable counting sort passes
+// (column first, then row), so a later triplet for the same cell overwrites
+// an earlier one and zero values are dropped, as with repeated
+// csr_matrix_set calls. Runs in O(n + rows + cols); when columns far
+// outnumber triplets, the column pass sorts keys instead, in O(n log n).
+CSRMatrix_t* csr_matrix_build(int rows, int cols, int n,
+                              int *ri, int *ci, int *vi) {
+    CSRMatrix_t *A = csr_matrix_create(rows, cols);
+    if (n == 0) {
+        return A;
+    }
+    csr_matrix_to_csr(A);
+    
+    int keyed = (cols / COUNT_SORT_RATIO > n);
+    int span = ((keyed || rows > cols) ? rows : cols) + 1;
+    long mark = scratch_mark();
+    scratch_reserve(sizeof(int) * (2L * n + span) + 4 * SCRATCH_ALIGN
+                    + (keyed ? sizeof(unsigned long long) * (long)n : 0));
+    int *order = (int*)scratch_alloc(sizeof(int) * n);
+    int *tmp = (int*)scratch_alloc(sizeof(int) * n);
+    int *count = (int*)scratch_alloc(sizeof(int) * span);
+    
+    // Pass 1: stable sort of triplet indices by column; the index breaks
+    // ties between keys
+    if (keyed) {
+        unsigned long long *keys = (unsigned long long*)scratch_alloc(
+            sizeof(unsigned long long) * n);
+        for (int i = 0; i < n; i++) {
+            keys[i] = ((unsigned long long)(unsigned)ci[i] << 32) | (unsigned)i;
+        }
+        qsort(keys, n, sizeof(unsigned long long), compare_keys);
+        for (int k = 0; k < n; k++) {
+            tmp[k] = (int)(keys[k] & 0xFFFFFFFFU);
+        }
+    } else {
+        memset(count, 0, sizeof(int) * (cols + 1));
+        for (int i = 0; i < n; i++) {
+            count[ci[i] + 1]++;
+        }
+        for (int c = 0; c < cols; c++) {
+            count[c + 1] += count[c];
+        }
+        for (int i = 0; i < n; i++) {
+            tmp[count[ci[i]]++] = i;
+        }
+    }
+    
+    // Pass 2: stable counting sort by row, keeping column order within rows
+    memset(count, 0, sizeof(int) * (rows + 1));
+    for (int i = 0; i < n; i++) {
+        count[ri[i] + 1]++;
+    }
+    for (int r = 0; r < rows; r++) {
+        count[r + 1] += count[r];
+    }
+    for (int k = 0; k < n; k++) {
+        int i = tmp[k];
+        order[count[ri[i]]++] = i;
+    }
+    
+    // Emit the last triplet of every run of equal cells, skipping zeros.
+    // As with csr_matrix_set, a cell takes its place in its row's input
+    // order from the triplet that last made it non-zero: tmp maps that
+    // triplet to the cell's entry, and every other triplet to -1. Values
+    // are stored as wide as the widest triplet needs.
+    int lo = INT_MAX, hi = INT_MIN, cap = n;
+    for (int i = 0; i < n; i++) {
+        if (vi[i] < lo && vi[i] != 0) lo = vi[i];
+        if (vi[i] > hi && vi[i] != 0) hi = vi[i];
+    }
+    int w = val_width(lo, hi);
+    storage_swap(A, storage_alloc(&cap, w), cap, w);
+    memset(tmp, -1, sizeof(int) * n);
+    int placed = -1;
+    for (int k = 0; k < n; k++) {
+        int i = order[k];
+        if (vi[i] == 0) {
+            placed = -1;
+        } else if (placed < 0) {
+            placed = i;
+        }
+        if (k + 1 < n && ri[order[k + 1]] == ri[i] 
+                      && ci[order[k + 1]] == ci[i]) {
+            continue;
+        }
+        if (vi[i] != 0) {
+            value_bound(A, vi[i]);
+            tmp[placed] = A->nnz;
+            entry_store(A, A->nnz, vi[i]);
+            A->cidx[A->nnz] = ci[i];
+            A->nnz++;
+            A->rptr[ri[i] + 1]++;
+        }
+        placed = -1;
+    }
+    for (int r = 0; r < rows; r++) {
+        A->rptr[r + 1] += A->rptr[r];
+    }
+    
+    // Rank each row's entries in input order, keeping the ranks only if
+    // some row was not read in column order
+    int *pord = (int*)mem_alloc(sizeof(int) * (A->nnz > 0 ? A->nnz : 1));
+    int sorted = 1;
+    memset(count, 0, sizeof(int) * rows);
+    for (int i = 0; i < n; i++) {
+        int e = tmp[i];
+        if (e < 0) continue;
+        pord[e] = count[ri[i]]++;
+        sorted &= (pord[e] == e - A->rptr[ri[i]]);
+    }
+    A->hashed = 0;
+    csr_matrix_pick_layout(A);
+    if (sorted) {
+        mem_free(pord);
+    } else {
+        A->pord = pord;
+    }
+    
+    scratch_release(mark);
+    return A;
+}
+
+// Check if matrix is small
+int is_small_matrix(CSRMatrix_t *A) {
+    if (A->rows > MAX_SMALL_DIM || A->cols > MAX_SMALL_DIM) return 0;
+    
+    // Bounds that rule the matrix out may just be loose, so tighten them
+    if (A->vlo < 0 || A->vhi > MAX_SMALL_VAL) {
+        A->vlo = INT_MAX;
+        A->vhi = INT_MIN;
+        for (int k = 0; k < A->nrs; k++) {
+            for (int i = A->rptr[k]; i < row_end(A, k); i++) {
+                value_bound(A, transformed_value(A, entry_value(A, i)));
+            }
+        }
+    }
+    return A->vlo >= 0 && A->vhi <= MAX_SMALL_VAL;
+}
+
+// Widen the value bounds of A to take in val
+void value_bound(CSRMatrix_t *A, int val) {
+    if (val < A->vlo) A->vlo = val;
+    if (val > A->vhi) A->vhi = val;
+}
+
+// Map the value bounds of A through v -> v*scale + offset, dropping them
+// to the whole int range if a value could wrap around
+void value_bounds_map(CSRMatrix_t *A, int scale, int offset) {
+    if (A->vlo > A->vhi) {
+        return;
+    }
+    long long lo = (long long)A->vlo * scale + offset;
+    long long hi = (long long)A->vhi * scale + offset;
+    if (lo > hi) {
+        long long t = lo;
+        lo = hi;
+        hi = t;
+    }
+    if (lo < INT_MIN || hi > INT_MAX) {
+        lo = INT_MIN;
+        hi = INT_MAX;
+    }
+    A->vlo = (int)lo;
+    A->vhi = (int)hi;
+}
+
+// Print matrix
+void csr_matrix_print(Writer_t *out, CSRMatrix_t *A, char *title) {
+    PROF_BEGIN(PROF_PRINT);
+    csr_matrix_apply(A);
+    write_fmt(out, "%s: %dx%d, nnz=%d\n", title, A->rows, A->cols, A->nnz);
+    
+    if (is_small_matrix(A)) {
+        // Print small matrix as grid, rendering each row from one walk over
+        // its entries into a line of spaces
+        for (int r = 0; r < A->rows; r++) {
+            char *line = writer_space(out, A->cols + 3);
+            line[0] = '[';
+            memset(line + 1, ' ', A->cols);
+            line[A->cols + 1] = ']';
+            line[A->cols + 2] = '\n';
+            int lo, hi;
+            row_bounds(A, (A->rperm != NULL) ? A->rperm[r] : r, &lo, &hi);
+            for (int i = lo; i < hi; i++) {
+                int c = (A->cinv != NULL) ? A->cinv[A->cidx[i]] : A->cidx[i];
+                int v = entry_value(A, i);
+                if (v != 0) line[c + 1] = '0' + v;
+            }
+            out->len += A->cols + 3;
+        }
+    } else {
+        // Print large matrix as non-zero elements, visiting only stored
+        // rows, in logical row and column order
+        csr_matrix_materialize(A);
+        long mark = scratch_mark();
+        int *seq = print_sequence(A);
+        if (A->nnz >= PAR_MIN_NNZ && par_threads() > 1) {
+            csr_matrix_print_par(out, A, seq);
+            scratch_release(mark);
+            PROF_END(PROF_PRINT);
+            return;
+        }
+        for (int k = 0; k < A->nrs; k++) {
+            int r = slot_row(A, k);
+            for (int j = A->rptr[k]; j < row_end(A, k); j++) {
+                int i = (seq != NULL) ? seq[j] : j;
+                char *p = writer_space(out, 3 * MAX_INT_CHARS + 5);
+                *p = '(';
+                out->len++;
+                write_int(out, r);
+                out->buf[out->len++] = ',';
+                write_int(out, A->cidx[i]);
+                out->buf[out->len++] = ')';
+                out->buf[out->len++] = '=';
+                write_int(out, entry_value(A, i));
+                out->buf[out->len++] = '\n';
+            }
+        }
+        scratch_release(mark);
+    }
+    PROF_END(PROF_PRINT);
+}
+
+// Order in which the list print of materialized matrix A visits its
+// entries, as a scratch buffer giving the entry at each position; NULL if
+// A has no input order and prints in storage order
+int* print_sequence(CSRMatrix_t *A) {
+    if (A->pord == NULL) {
+        return NULL;
+    }
+    scratch_reserve(sizeof(int) * (long)A->nnz + SCRATCH_ALIGN);
+    int *seq = (int*)scratch_alloc(sizeof(int) * (long)A->nnz);
+    for (int k = 0; k < A->nrs; k++) {
+        for (int i = A->rptr[k]; i < row_end(A, k); i++) {
+            seq[A->rptr[k] + A->pord[i]] = i;
+        }
+    }
+    return seq;
+}
+
+// Copy matrix
+CSRMatrix_t* csr_matrix_copy(CSRMatrix_t *A) {
+    PROF_BEGIN(PROF_COPY);
+    CSRMatrix_t *copy = csr_matrix_create(A->rows, A->cols);
+    csr_matrix_pack(A);
+    
+    // Allocate memory for values and column indices. A snapshot keeps no
+    // value bounds, so they are found from its values; without a pending
+    // transform the bounds hold for the stored values, which may narrow.
+    copy->vlo = A->vlo;
+    copy->vhi = A->vhi;
+    if (A->nnz > 0) {
+        int cap = A->cap, w = A->vbytes;
+        if (A->snap != NULL) {
+            copy->vlo = INT_MAX;
+            copy->vhi = INT_MIN;
+            for (int i = 0; i < A->nnz; i++) {
+                value_bound(copy, entry_value(A, i));
+            }
+        }
+        if (A->scale == 1 && A->offset == 0 
+                && val_width(copy->vlo, copy->vhi) < w) {
+            w = val_width(copy->vlo, copy->vhi);
+        }
+        storage_swap(copy, storage_alloc(&cap, w), cap, w);
+        
+        // Copy values and column indices
+        vals_convert(A->vals, A->vbytes, copy->vals, w, A->nnz);
+        memcpy(copy->cidx, A->cidx, sizeof(int) * A->nnz);
+        copy->nnz = A->nnz;
+    }
+    
+    // Copy the stored rows in the same row mode
+    if (A->rid == NULL) {
+        csr_matrix_to_csr(copy);
+    } else {
+        copy->rcap = A->nrs + 1;
+        copy->rid = (int*)mem_realloc(copy->rid, sizeof(int) * copy->rcap);
+        copy->rptr = (int*)mem_realloc(copy->rptr, sizeof(int) * copy->rcap);
+        assert(copy->rid != NULL && copy->rptr != NULL);
+        memcpy(copy->rid, A->rid, sizeof(int) * A->nrs);
+    }
+    copy->nrs = A->nrs;
+    memcpy(copy->rptr, A->rptr, sizeof(int) * (A->nrs + 1));
+    
+    // Copy any pending permutation
+    if (A->rperm != NULL) {
+        copy->rperm = (int*)mem_alloc(sizeof(int) * A->rows);
+        copy->rinv = (int*)mem_alloc(sizeof(int) * A->rows);
+        assert(copy->rperm != NULL && copy->rinv != NULL);
+        memcpy(copy->rperm, A->rperm, sizeof(int) * A->rows);
+        memcpy(copy->rinv, A->rinv, sizeof(int) * A->rows);
+    }
+    if (A->cperm != NULL) {
+        copy->cperm = (int*)mem_alloc(sizeof(int) * A->cols);
+        copy->cinv = (int*)mem_alloc(sizeof(int) * A->cols);
+        assert(copy->cperm != NULL && copy->cinv != NULL);
+        memcpy(copy->cperm, A->cperm, sizeof(int) * A->cols);
+        memcpy(copy->cinv, A->cinv, sizeof(int) * A->cols);
+    }
+    copy->zeros = A->zeros;
+    copy->scale = A->scale;
+    copy->offset = A->offset;
+    copy->drop = A->drop;
+    copy->hash = A->hash;
+    copy->hashed = A->hashed;
+    PROF_END(PROF_COPY);
+    
+    return copy;
+}
+
+// Forget the input order of A's entries, which a matrix loaded from a
+// snapshot reads from the file's mapping
+void drop_print_order(CSRMatrix_t *A) {
+    if (A->snap == NULL) {
+        mem_free(A->pord);
+    }
+    A->pord = NULL;
+}
+
+// Prepare A for a write to its entries. A matrix loaded from a snapshot is
+// read-only, and as every write may move entries, their input order is
+// forgotten.
+void csr_matrix_will_write(CSRMatrix_t *A) {
+    assert(A->snap == NULL);
+    drop_print_order(A);
+}
+
+/* Column index --------------------------------------------------------------*/
+
+// Build the column index from the stored entries
+void csr_matrix_index_cols(CSRMatrix_t *A) {
+    PROF_BEGIN(PROF_INDEX);
+    csr_matrix_drop_index(A);
+    ColIndex_t *x = (ColIndex_t*)mem_alloc(sizeof(ColIndex_t));
+    x->rows = (int**)mem_alloc(sizeof(int*) * (A->cols > 0 ? A->cols : 1));
+    x->len = (int*)mem_alloc(sizeof(int) * (A->cols > 0 ? A->cols : 1));
+    x->cap = (int*)mem_alloc(sizeof(int) * (A->cols > 0 ? A->cols : 1));
+    x->stamp = (int*)mem_alloc(sizeof(int) * (A->rows > 0 ? A->rows : 1));
+    x->epoch = 0;
+    memset(x->len, 0, sizeof(int) * A->cols);
+    memset(x->stamp, 0, sizeof(int) * A->rows);
+    
+    // Size each column's list exactly, then fill it
+    for (int k = 0; k < A->nrs; k++) {
+        for (int i = A->rptr[k]; i < row_end(A, k); i++) {
+            x->len[A->cidx[i]]++;
+        }
+    }
+    for (int c = 0; c < A->cols; c++) {
+        x->cap[c] = x->len[c];
+        x->rows[c] = (x->len[c] > 0) 
+                   ? (int*)mem_alloc(sizeof(int) * x->len[c]) : NULL;
+        x->len[c] = 0;
+    }
+    for (int k = 0; k < A->nrs; k++) {
+        int p = slot_row(A, k);
+        for (int i = A->rptr[k]; i < row_end(A, k); i++) {
+            x->rows[A->cidx[i]][x->len[A->cidx[i]]++] = p;
+        }
+    }
+    A->csc = x;
+    PROF_END(PROF_INDEX);
+}
+
+// Discard the column index, if any; it is rebuilt when next needed
+void csr_matrix_drop_index(CSRMatrix_t *A) {
+    ColIndex_t *x = A->csc;
+    if (x == NULL) {
+        return;
+    }
     for (int c = 0; c < A->cols; c++) {
-        csr_matrix_set(A, r2, c, 0);
+        mem_free(x->rows[c]);
+    }
+    mem_free(x->rows);
+    mem_free(x->len);
+    mem_free(x->cap);
+    mem_free(x->stamp);
+    mem_free(x);
+    A->csc = NULL;
+}
+
+// List physical row p under physical column c
+void col_index_add(ColIndex_t *x, int c, int p) {
+    if (x->len[c] >= x->cap[c]) {
+        x->cap[c] = (x->cap[c] == 0) ? 1 : x->cap[c] * GROWTH_FACTOR;
+        x->rows[c] = (int*)mem_realloc(x->rows[c], sizeof(int) * x->cap[c]);
+    }
+    x->rows[c][x->len[c]++] = p;
+}
+
+// Remove physical row p from the list of physical column c
+void col_index_remove(ColIndex_t *x, int c, int p) {
+    int j = 0;
+    while (x->rows[c][j] != p) {
+        j++;
+    }
+    x->rows[c][j] = x->rows[c][--x->len[c]];
+}
+
+// List (sign 1) or unlist (sign -1) physical row p under all its columns
+void col_index_row(CSRMatrix_t *A, int p, int sign) {
+    int lo, hi;
+    row_bounds(A, p, &lo, &hi);
+    for (int i = lo; i < hi; i++) {
+        if (sign > 0) {
+            col_index_add(A->csc, A->cidx[i], p);
+        } else {
+            col_index_remove(A->csc, A->cidx[i], p);
+        }
+    }
+}
+
+// Select the column index mode from --column-index=MODE, or the
+// COLUMN_INDEX_ENV environment variable; lazy by default
+ColIndexMode_t column_index_mode(int argc, char *argv[]) {
+    char *name = getenv(COLUMN_INDEX_ENV);
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--column-index=", 15) == 0) {
+            name = argv[i] + 15;
+        }
+    }
+    if (name == NULL || strcmp(name, "lazy") == 0) {
+        return COLINDEX_LAZY;
+    } else if (strcmp(name, "off") == 0) {
+        return COLINDEX_OFF;
+    } else if (strcmp(name, "eager") == 0) {
+        return COLINDEX_EAGER;
+    }
+    fprintf(stderr, "unknown column index mode '%s' (off, lazy, eager)\n", 
+            name);
+    exit(EXIT_FAILURE);
+}
+
+/* Vector kernels ------------------------------------------------------------*/
+
+// Transform n values in place, v -> v*scale + offset with wrapping
+// arithmetic; returns 1 if any result is zero
+int affine_scalar(int *vals, int n, int scale, int offset) {
+    int zero = 0;
+    for (int i = 0; i < n; i++) {
+        vals[i] = (int)((unsigned)vals[i] * (unsigned)scale 
+                        + (unsigned)offset);
+        zero |= (vals[i] == 0);
+    }
+    return zero;
+}
+
+// Transform n entries as affine_scalar, writing those that stay non-zero
+// to dvals and dcidx, which are separate buffers or start no later than
+// vals and cidx; returns the number kept
+int compact_scalar(int *vals, int *cidx, int n, int *dvals, int *dcidx, 
+                   int scale, int offset) {
+    int m = 0;
+    for (int i = 0; i < n; i++) {
+        int val = (int)((unsigned)vals[i] * (unsigned)scale 
+                        + (unsigned)offset);
+        if (val != 0) {
+            dvals[m] = val;
+            dcidx[m] = cidx[i];
+            m++;
+        }
+    }
+    return m;
+}
+
+// Check if n ints at a and b are equal. The C library's memcmp already
+// picks a vector code path at load time, and measured faster than
+// hand-written SSE2 and AVX2 loops, so every code path uses it.
+int equal_ints(const int *a, const int *b, int n) {
+    if (n >= PAR_MIN_NNZ && par_threads() > 1) {
+        return equal_ints_par(a, b, n);
+    }
+    return n == 0 || memcmp(a, b, sizeof(int) * n) == 0;
+}
+
+#ifdef HAVE_X86_SIMD
+// 32-bit products of four lanes; SSE2 only multiplies even lanes to 64 bits
+static inline __m128i mullo_sse2(__m128i a, __m128i b) {
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+// affine_scalar, four values at a time
+int affine_sse2(int *vals, int n, int scale, int offset) {
+    __m128i s = _mm_set1_epi32(scale), o = _mm_set1_epi32(offset);
+    __m128i zero = _mm_setzero_si128(), any = zero;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((__m128i*)(vals + i));
+        v = _mm_add_epi32(mullo_sse2(v, s), o);
+        any = _mm_or_si128(any, _mm_cmpeq_epi32(v, zero));
+        _mm_storeu_si128((__m128i*)(vals + i), v);
+    }
+    return affine_scalar(vals + i, n - i, scale, offset) 
+        || _mm_movemask_epi8(any) != 0;
+}
+
+// Lane orders that move the kept lanes of each 8-bit mask to the front
+static int pack_lanes[256][8];
+
+// affine_scalar, eight values at a time
+__attribute__((target("avx2")))
+int affine_avx2(int *vals, int n, int scale, int offset) {
+    __m256i s = _mm256_set1_epi32(scale), o = _mm256_set1_epi32(offset);
+    __m256i zero = _mm256_setzero_si256(), any = zero;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((__m256i*)(vals + i));
+        v = _mm256_add_epi32(_mm256_mullo_epi32(v, s), o);
+        any = _mm256_or_si256(any, _mm256_cmpeq_epi32(v, zero));
+        _mm256_storeu_si256((__m256i*)(vals + i), v);
+    }
+    return affine_scalar(vals + i, n - i, scale, offset) 
+        || !_mm256_testz_si256(any, any);
+}
+
+// compact_scalar, eight entries at a time: the kept lanes are packed to
+// the front with one permute and stored whole, as the destination never
+// runs ahead of the lanes already loaded
+__attribute__((target("avx2")))
+int compact_avx2(int *vals, int *cidx, int n, int *dvals, int *dcidx, 
+                 int scale, int offset) {
+    __m256i s = _mm256_set1_epi32(scale), o = _mm256_set1_epi32(offset);
+    __m256i zero = _mm256_setzero_si256();
+    int i = 0, m = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((__m256i*)(vals + i));
+        __m256i c = _mm256_loadu_si256((__m256i*)(cidx + i));
+        v = _mm256_add_epi32(_mm256_mullo_epi32(v, s), o);
+        int keep = ~_mm256_movemask_ps(
+            _mm256_castsi256_ps(_mm256_cmpeq_epi32(v, zero))) & 0xFF;
+        __m256i lanes = _mm256_loadu_si256((__m256i*)pack_lanes[keep]);
+        _mm256_storeu_si256((__m256i*)(dvals + m), 
+                            _mm256_permutevar8x32_epi32(v, lanes));
+        _mm256_storeu_si256((__m256i*)(dcidx + m), 
+                            _mm256_permutevar8x32_epi32(c, lanes));
+        m += __builtin_popcount(keep);
+    }
+    return m + compact_scalar(vals + i, cidx + i, n - i, dvals + m, 
+                              dcidx + m, scale, offset);
+}
+#endif
+
+// Fill k with the kernels of the named code path (scalar, sse2 or avx2);
+// returns 0 if this build or CPU lacks it
+int kernels_select(const char *name, Kernels_t *k) {
+    k->name = "scalar";
+    k->affine = affine_scalar;
+    k->compact = compact_scalar;
+    if (strcmp(name, "scalar") == 0) {
+        return 1;
+    }
+#ifdef HAVE_X86_SIMD
+    if (strcmp(name, "sse2") == 0) {
+        k->name = "sse2";
+        k->affine = affine_sse2;
+        return 1;
+    }
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        for (int mask = 0; mask < 256; mask++) {
+            int n = 0;
+            for (int lane = 0; lane < 8; lane++) {
+                if (mask & (1 << lane)) pack_lanes[mask][n++] = lane;
+            }
+            while (n < 8) pack_lanes[mask][n++] = 0;
+        }
+        k->name = "avx2";
+        k->affine = affine_avx2;
+        k->compact = compact_avx2;
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+// Pick the widest code path the CPU supports, or the one SIMD_ENV names.
+// Called once before any thread starts.
+void kernels_init(void) {
+    char *name = getenv(SIMD_ENV);
+    if (name != NULL && kernels_select(name, &kernels)) {
+        return;
+    }
+    if (!kernels_select("avx2", &kernels) 
+            && !kernels_select("sse2", &kernels)) {
+        kernels_select("scalar", &kernels);
+    }
+}
+
+// Time each code path of every kernel at sizes 10^4 to 10^7, printing
+// nanoseconds per element and the speedup over the scalar path
+int bench_kernels(Writer_t *out) {
+    const char *paths[] = {"scalar", "sse2", "avx2"};
+    const char *names[] = {"affine", "compact"};
+    int max = 10000000;
+    int *vals = (int*)mem_alloc(sizeof(int) * max);
+    int *cidx = (int*)mem_alloc(sizeof(int) * max);
+    int *dvals = (int*)mem_alloc(sizeof(int) * max);
+    int *dcidx = (int*)mem_alloc(sizeof(int) * max);
+    // Values 1..8, so an add of -1 drops one entry in eight
+    unsigned seed = 1;
+    for (int i = 0; i < max; i++) {
+        seed = seed * 1103515245u + 12345u;
+        vals[i] = (int)(seed >> 16) % 8 + 1;
+        cidx[i] = i;
+    }
+    write_fmt(out, "%-8s %9s %-7s %9s %8s\n", 
+              "kernel", "n", "path", "ns/elem", "speedup");
+    volatile long sink = 0;
+    for (int kernel = 0; kernel < 2; kernel++) {
+        for (int n = 10000; n <= max; n *= 10) {
+            double base = 0;
+            for (int p = 0; p < 3; p++) {
+                Kernels_t k;
+                if (!kernels_select(paths[p], &k)) continue;
+                long reps = 200000000L / n;
+                clock_t start = clock();
+                for (long rep = 0; rep < reps; rep++) {
+                    if (kernel == 0) {
+                        // The identity map costs as much as any other
+                        sink += k.affine(vals, n, 1, 0);
+                    } else {
+                        sink += k.compact(vals, cidx, n, dvals, dcidx, 1, -1);
+                    }
+                }
+                double ns = 1e9 * (double)(clock() - start) / CLOCKS_PER_SEC 
+                          / ((double)reps * n);
+                if (p == 0) base = ns;
+                write_fmt(out, "%-8s %9d %-7s %9.3f %7.2fx\n", names[kernel], 
+                          n, k.name, ns, (ns > 0) ? base / ns : 0.0);
+            }
+        }
+    }
+    mem_free(vals);
+    mem_free(cidx);
+    mem_free(dvals);
+    mem_free(dcidx);
+    return EXIT_SUCCESS;
+}
+
+/* Parallel execution --------------------------------------------------------*/
+
+// Read the worker count: --threads=N, else THREADS_ENV, else all cores.
+// The pool itself starts on first use.
+void par_config(int argc, char *argv[]) {
+    int threads = 1;
+#ifdef HAVE_THREADS
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = (cores > 0) ? (int)cores : 1;
+    char *env = getenv(THREADS_ENV);
+    if (env != NULL && env[0] != '\0') {
+        threads = atoi(env);
+    }
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--threads=", 10) == 0) {
+            threads = atoi(argv[i] + 10);
+        }
+    }
+    if (threads < 1) threads = 1;
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+    par_pool.threads = threads;
+#else
+    (void)argc;
+    (void)argv;
+    (void)threads;
+#endif
+}
+
+// Number of threads a parallel operation runs on, the caller included
+int par_threads(void) {
+#ifdef HAVE_THREADS
+    return par_pool.threads;
+#else
+    return 1;
+#endif
+}
+
+#ifdef HAVE_THREADS
+// Claim and run chunks of job until none are left
+void par_work(ParJob_t *job) {
+    int i;
+    while ((i = atomic_fetch_add(&job->next, 1)) < job->nchunks) {
+        job->fn(job->ctx, i);
+    }
+}
+
+// Pool thread: join each new job until it has no chunks left to claim
+void* par_worker(void *arg) {
+    (void)arg;
+    long seen = 0;
+    pthread_mutex_lock(&par_pool.lock);
+    for (;;) {
+        while (par_pool.job == NULL || par_pool.generation == seen) {
+            pthread_cond_wait(&par_pool.wake, &par_pool.lock);
+        }
+        seen = par_pool.generation;
+        ParJob_t *job = par_pool.job;
+        par_pool.active++;
+        pthread_mutex_unlock(&par_pool.lock);
+        par_work(job);
+        pthread_mutex_lock(&par_pool.lock);
+        if (--par_pool.active == 0) {
+            pthread_cond_signal(&par_pool.idle);
+        }
+    }
+    return NULL;
+}
+
+// Start the pool threads; the caller of par_run is the last worker
+void par_start(void) {
+    pthread_mutex_init(&par_pool.lock, NULL);
+    pthread_mutex_init(&par_pool.busy, NULL);
+    pthread_cond_init(&par_pool.wake, NULL);
+    pthread_cond_init(&par_pool.idle, NULL);
+    for (int t = 1; t < par_pool.threads; t++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, par_worker, NULL) != 0) {
+            par_pool.threads = t;
+            break;
+        }
+        pthread_detach(tid);
+    }
+}
+#endif
+
+// Run fn(ctx, i) for every chunk i < nchunks, on the pool when it is
+// free. The pool runs one job at a time, so a call made while it is busy
+// (from another batch run, or from inside a chunk) runs serially instead.
+void par_run(int nchunks, void (*fn)(void*, int), void *ctx) {
+#ifdef HAVE_THREADS
+    if (nchunks > 1 && par_pool.threads > 1) {
+        pthread_once(&par_once, par_start);
+        if (pthread_mutex_trylock(&par_pool.busy) == 0) {
+            ParJob_t job = {fn, ctx, nchunks, 0};
+            pthread_mutex_lock(&par_pool.lock);
+            par_pool.job = &job;
+            par_pool.generation++;
+            pthread_cond_broadcast(&par_pool.wake);
+            pthread_mutex_unlock(&par_pool.lock);
+            par_work(&job);
+            // The job lives on this stack, so wait for every thread in it
+            pthread_mutex_lock(&par_pool.lock);
+            par_pool.job = NULL;
+            while (par_pool.active > 0) {
+                pthread_cond_wait(&par_pool.idle, &par_pool.lock);
+            }
+            pthread_mutex_unlock(&par_pool.lock);
+            pthread_mutex_unlock(&par_pool.busy);
+            return;
+        }
+    }
+#endif
+    for (int i = 0; i < nchunks; i++) {
+        fn(ctx, i);
+    }
+}
+
+// Split the slots of A from slot from into at most max chunks of about
+// per entries each, by row extent, storing chunk j as slots bounds[j] to
+// bounds[j+1]-1; returns the number of chunks
+int par_split(CSRMatrix_t *A, int from, long per, int *bounds, int max) {
+    int j = 0;
+    bounds[0] = from;
+    while (bounds[j] < A->nrs && j < max) {
+        long want = A->rptr[bounds[j]] + per;
+        // First slot after the chunk start that begins at or past want
+        int lo = bounds[j] + 1, hi = A->nrs;
+        while (lo < hi) {
+            int mid = lo + (hi - lo) / 2;
+            if (A->rptr[mid] < want) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        bounds[++j] = lo;
+    }
+    return j;
+}
+
+// Split A into nnz-balanced chunks for the pool, or one chunk below
+// PAR_MIN_NNZ entries or without workers; returns the number of chunks
+int par_chunks(CSRMatrix_t *A, int *bounds) {
+    int threads = par_threads();
+    if (A->nnz < PAR_MIN_NNZ || threads <= 1) {
+        bounds[0] = 0;
+        bounds[1] = A->nrs;
+        return 1;
+    }
+    long per = A->rptr[A->nrs] / (PAR_SPLIT * threads) + 1;
+    return par_split(A, 0, per, bounds, PAR_MAX_CHUNKS);
+}
+
+// Chunk of apply without an add: transform a range of packed entries
+void par_affine(void *arg, int j) {
+    ParApply_t *w = (ParApply_t*)arg;
+    CSRMatrix_t *A = w->A;
+    long lo = (long)A->nnz * j / w->n, hi = (long)A->nnz * (j + 1) / w->n;
+    w->count[j] = affine_width(entry_vals(A, (int)lo), A->vbytes, 
+                               (int)(hi - lo), A->scale, A->offset);
+}
+
+// Chunk of apply with an add, first pass: compact each row of the chunk
+// in place, counting the entries kept per slot, in the chunk, and the
+// slots left non-empty
+void par_compact(void *arg, int j) {
+    ParApply_t *w = (ParApply_t*)arg;
+    CSRMatrix_t *A = w->A;
+    int kept = 0, slots = 0, n = A->rptr[w->bounds[j]];
+    for (int k = w->bounds[j]; k < w->bounds[j + 1]; k++) {
+        int start = A->rptr[k], end = row_end(A, k);
+        int m = compact_width(entry_vals(A, start), A->cidx + start, 
+                              end - start, entry_vals(A, n), A->cidx + n, 
+                              A->vbytes, A->scale, A->offset);
+        w->len[k] = m;
+        n += m;
+        kept += m;
+        slots += (m > 0);
+    }
+    w->count[j] = kept;
+    w->slots[j] = slots;
+}
+
+// Second pass: copy the chunk's kept entries to its place in the new
+// storage and fill in its row pointers, from the chunk's offsets
+void par_place(void *arg, int j) {
+    ParApply_t *w = (ParApply_t*)arg;
+    CSRMatrix_t *A = w->A;
+    int from = A->rptr[w->bounds[j]], at = w->count[j], m = w->slots[j];
+    if (w->kept[j] > 0) {
+        memcpy(w->vals + (size_t)A->vbytes * at, entry_vals(A, from), 
+               (size_t)A->vbytes * w->kept[j]);
+        memcpy(w->cidx + at, A->cidx + from, sizeof(int) * w->kept[j]);
+    }
+    for (int k = w->bounds[j]; k < w->bounds[j + 1]; k++) {
+        // DCSR mode drops slots whose row became empty
+        if (A->rid == NULL || w->len[k] > 0) {
+            if (A->rid != NULL) w->rid[m] = A->rid[k];
+            w->rptr[m++] = at;
+            at += w->len[k];
+        }
+    }
+}
+
+// Apply the pending transform of packed matrix A on the pool. Without an
+// add, entries are transformed in equal ranges. With one, chunks compact
+// their rows in place, an exclusive scan of their counts gives each
+// chunk's offsets, and chunks then move their entries to a fresh storage
+// block and rebuild their part of rptr (and rid) in parallel.
+void csr_matrix_apply_par(CSRMatrix_t *A, int *bounds, int nchunks) {
+    ParApply_t w;
+    int count[PAR_MAX_CHUNKS], kept[PAR_MAX_CHUNKS], slots[PAR_MAX_CHUNKS];
+    w.A = A;
+    w.bounds = bounds;
+    w.n = nchunks;
+    w.count = count;
+    if (!A->drop) {
+        par_run(nchunks, par_affine, &w);
+        A->zeros = 0;
+        for (int j = 0; j < nchunks; j++) {
+            A->zeros |= count[j];
+        }
+        A->scale = 1;
+        A->offset = 0;
+        return;
+    }
+    long mark = scratch_mark();
+    w.len = (int*)scratch_alloc(sizeof(int) * (A->nrs > 0 ? A->nrs : 1));
+    w.slots = slots;
+    par_run(nchunks, par_compact, &w);
+    
+    // Exclusive scan of the chunk counts into entry and slot offsets
+    int nnz = 0, nrs = 0;
+    for (int j = 0; j < nchunks; j++) {
+        kept[j] = count[j];
+        count[j] = nnz;
+        nnz += kept[j];
+        int s = slots[j];
+        slots[j] = nrs;
+        nrs += (A->rid == NULL) ? bounds[j + 1] - bounds[j] : s;
+    }
+    w.kept = kept;
+    int cap = A->cap;
+    char *block = storage_alloc(&cap, A->vbytes);
+    w.cidx = (int*)block;
+    w.vals = storage_vals(block, cap);
+    w.rptr = (int*)mem_alloc(sizeof(int) * A->rcap);
+    w.rid = (A->rid != NULL) ? (int*)mem_alloc(sizeof(int) * A->rcap) : NULL;
+    par_run(nchunks, par_place, &w);
+    w.rptr[nrs] = nnz;
+    scratch_release(mark);
+    
+    storage_swap(A, block, cap, A->vbytes);
+    mem_free(A->rptr);
+    mem_free(A->rid);
+    A->rptr = w.rptr;
+    A->rid = w.rid;
+    if (nnz != A->nnz) {
+        csr_matrix_drop_index(A);
+    }
+    A->nrs = nrs;
+    A->nnz = nnz;
+    A->zeros = 0;
+    A->scale = 1;
+    A->offset = 0;
+    A->drop = 0;
+}
+
+// Chunk of a hash recomputation: sum the cell hashes of its slots
+void par_hash(void *arg, int j) {
+    ParApply_t *w = (ParApply_t*)arg;
+    CSRMatrix_t *A = w->A;
+    unsigned long long sum = 0;
+    for (int k = w->bounds[j]; k < w->bounds[j + 1]; k++) {
+        int p = slot_row(A, k);
+        sum += row_hash(A, p, (A->rinv != NULL) ? A->rinv[p] : p);
+    }
+    w->sums[j] = sum;
+}
+
+// Chunk of a comparison: compare one range unless a difference was found
+void par_equal(void *arg, int j) {
+    ParEqual_t *w = (ParEqual_t*)arg;
+    if (atomic_load(&w->differ)) {
+        return;
+    }
+    long lo = (long)w->len * j / w->n, hi = (long)w->len * (j + 1) / w->n;
+    if (memcmp(w->a + lo, w->b + lo, sizeof(int) * (hi - lo)) != 0) {
+        atomic_store(&w->differ, 1);
+    }
+}
+
+// Compare n ints at a and b on the pool, in PAR_SPLIT ranges per thread
+int equal_ints_par(const int *a, const int *b, int n) {
+    ParEqual_t w;
+    w.a = a;
+    w.b = b;
+    w.len = n;
+    w.n = PAR_SPLIT * par_threads();
+    atomic_init(&w.differ, 0);
+    par_run(w.n, par_equal, &w);
+    return !atomic_load(&w.differ);
+}
+
+// Chunk of list-mode printing: format its slots into its own buffer
+void par_print(void *arg, int j) {
+    ParPrint_t *w = (ParPrint_t*)arg;
+    CSRMatrix_t *A = w->A;
+    Writer_t *out = w->bufs[j];
+    out->len = 0;
+    for (int k = w->bounds[j]; k < w->bounds[j + 1]; k++) {
+        int r = slot_row(A, k);
+        for (int j = A->rptr[k]; j < row_end(A, k); j++) {
+            int i = (w->seq != NULL) ? w->seq[j] : j;
+            char *p = writer_space(out, 3 * MAX_INT_CHARS + 5);
+            *p = '(';
+            out->len++;
+            write_int(out, r);
+            out->buf[out->len++] = ',';
+            write_int(out, A->cidx[i]);
+            out->buf[out->len++] = ')';
+            out->buf[out->len++] = '=';
+            write_int(out, entry_value(A, i));
+            out->buf[out->len++] = '\n';
+        }
+    }
+}
+
+// Print the entries of materialized matrix A in list mode on the pool, a
+// round of chunks of about PAR_PRINT_CHUNK entries at a time, each chunk
+// into its own buffer; the buffers are then written out in order. Each
+// row's entries go in the order seq gives, as from print_sequence.
+void csr_matrix_print_par(Writer_t *out, CSRMatrix_t *A, int *seq) {
+    ParPrint_t w;
+    int bounds[PAR_MAX_CHUNKS + 1];
+    Writer_t *bufs[PAR_MAX_CHUNKS];
+    w.A = A;
+    w.seq = seq;
+    w.bounds = bounds;
+    w.bufs = bufs;
+    int used = 0, round = PAR_SPLIT * par_threads();
+    if (round > PAR_MAX_CHUNKS) round = PAR_MAX_CHUNKS;
+    for (int from = 0; from < A->nrs; from = bounds[w.n]) {
+        w.n = par_split(A, from, PAR_PRINT_CHUNK, bounds, round);
+        while (used < w.n) {
+            bufs[used++] = writer_create(NULL);
+        }
+        par_run(w.n, par_print, &w);
+        for (int j = 0; j < w.n; j++) {
+            write_bytes(out, bufs[j]->buf, bufs[j]->len);
+        }
+    }
+    for (int j = 0; j < used; j++) {
+        writer_free(bufs[j]);
+    }
+}
+
+/* Operations implementation -------------------------------------------------*/
+
+void op_set(CSRMatrix_t *A, int r, int c, int val) {
+    csr_matrix_set(A, r, c, val);
+}
+
+void op_swap(CSRMatrix_t *A, int r1, int c1, int r2, int c2) {
+    int val1 = csr_matrix_get(A, r1, c1);
+    int val2 = csr_matrix_get(A, r2, c2);
+    csr_matrix_set(A, r1, c1, val2);
+    csr_matrix_set(A, r2, c2, val1);
+}
+
+// Multiply all stored values by val, deferred into the pending transform.
+// Products that become zero stay stored until the next add. Once an add is
+// pending, only odd factors compose, since for them x*val == 0 only if x == 0
+// and the add's zero test is preserved.
+void op_multiply(CSRMatrix_t *A, int val) {
+    if (A->drop && val % 2 == 0) {
+        csr_matrix_apply(A);
+    }
+    A->scale = (int)((unsigned)A->scale * (unsigned)val);
+    A->offset = (int)((unsigned)A->offset * (unsigned)val);
+    value_bounds_map(A, val, 0);
+    A->zeros = 1;
+    if (val != 1) A->hashed = 0;
+}
+
+// Add val to all stored values, deferred into the pending transform; values
+// that become zero are removed when it is applied. A second add would need
+// its own zero test, so the earlier one is applied first.
+void op_add(CSRMatrix_t *A, int val) {
+    if (A->drop) {
+        csr_matrix_apply(A);
+    }
+    A->offset = (int)((unsigned)A->offset + (unsigned)val);
+    A->drop = 1;
+    value_bounds_map(A, 1, val);
+    // Stored zeros either become non-zero or are removed
+    A->zeros = 0;
+    if (val != 0) A->hashed = 0;
+}
+
+// Copy row r1 over row r2 by splicing the source segment into place of the
+// destination segment. Stored zeros are not copied, and copying a row onto
+// itself clears it, matching the original clear-then-copy behaviour.
+void op_copy_row(CSRMatrix_t *A, int r1, int r2) {
+    assert(r1 >= 0 && r1 < A->rows && r2 >= 0 && r2 < A->rows);
+    csr_matrix_will_write(A);
+    int lr2 = r2;
+    // Rows share one column map, so the copy works on physical rows
+    if (A->rperm != NULL) {
+        r1 = A->rperm[r1];
+        r2 = A->rperm[r2];
+    }
+    if (A->hashed) {
+        hash_row(A, r2, lr2, -1);
+        if (r1 != r2) hash_row(A, r1, lr2, 1);
+    }
+    int src, src_end, src_len = 0;
+    row_bounds(A, r1, &src, &src_end);
+    if (r1 != r2) {
+        for (int i = src; i < src_end; i++) {
+            src_len += (transformed_value(A, entry_value(A, i)) != 0);
+        }
+    }
+    if (src_len == 0 && row_slot(A, r2) == -1) {
+        return;
+    }
+    if (A->csc != NULL) {
+        col_index_row(A, r2, -1);
+    }
+    int k = row_open(A, r2);
+    int dst = A->rptr[k], dst_end = row_end(A, k);
+    int delta = src_len - (dst_end - dst);
+    if (row_use_gaps(A, (delta != 0) ? A->nnz - dst_end : 0)) {
+        // Overwrite the destination within its room; rows never overlap
+        row_make_room(A, k, src_len);
+        int n = A->rptr[k];
+        row_bounds(A, r1, &src, &src_end);
+        for (int i = src; i < src_end && src_len > 0; i++) {
+            if (transformed_value(A, entry_value(A, i)) != 0) {
+                entry_store(A, n, entry_value(A, i));
+                A->cidx[n] = A->cidx[i];
+                n++;
+            }
+        }
+        A->rend[k] = n;
+        A->nnz += delta;
+        if (A->csc != NULL) {
+            col_index_row(A, r2, 1);
+        }
+        row_close(A, k);
+        return;
+    }
+    csr_matrix_reserve(A, A->nnz + delta);
+    
+    // Open or close the gap after the destination row
+    PROF_SHIFT(A->nnz - dst_end);
+    memmove(entry_vals(A, dst_end + delta), entry_vals(A, dst_end), 
+            (size_t)A->vbytes * (A->nnz - dst_end));
+    memmove(A->cidx + dst_end + delta, A->cidx + dst_end, 
+            sizeof(int) * (A->nnz - dst_end));
+    A->nnz += delta;
+    shift_rptr(A, k, delta);
+    
+    // Fill the destination from the (possibly shifted) source segment
+    if (src_len > 0) {
+        int n = dst;
+        row_bounds(A, r1, &src, &src_end);
+        for (int i = src; i < src_end; i++) {
+            if (transformed_value(A, entry_value(A, i)) != 0) {
+                entry_store(A, n, entry_value(A, i));
+                A->cidx[n] = A->cidx[i];
+                n++;
+            }
+        }
+        if (A->csc != NULL) {
+            col_index_row(A, r2, 1);
+        }
+    } else {
+        row_close(A, k);
+    }
+}
+
+// Copy column c1 over column c2 in one pass over the stored rows, editing
+// each row's entries for the two physical columns while compacting into a
+// fresh, packed array. As with rows, copying a column onto itself clears
+// it.
+void op_copy_col(CSRMatrix_t *A, int c1, int c2) {
+    assert(c1 >= 0 && c1 < A->cols && c2 >= 0 && c2 < A->cols);
+    csr_matrix_will_write(A);
+    int p1 = (A->cperm != NULL) ? A->cperm[c1] : c1;
+    int p2 = (A->cperm != NULL) ? A->cperm[c2] : c2;
+    if (A->use_csc) {
+        if (A->csc == NULL) {
+            csr_matrix_index_cols(A);
+        }
+        op_copy_col_indexed(A, p1, p2, c2);
+        return;
+    }
+    int cap = A->nnz + A->nrs, w = A->vbytes;
+    char *block = storage_alloc(&cap, w);
+    int *cidx = (int*)block;
+    char *vals = storage_vals(block, cap);
+    
+    int n = 0, m = 0;
+    for (int k = 0; k < A->nrs; k++) {
+        int start = A->rptr[k], end = row_end(A, k);
+        int row = slot_row(A, k);
+        int lr = (A->rinv != NULL) ? A->rinv[row] : row;
+        
+        // New value of the destination cell, as a stored value
+        int src = 0, old = 0;
+        for (int i = start; i < end && A->cidx[i] <= p2; i++) {
+            if (A->cidx[i] == p2) old = transformed_value(A, entry_value(A, i));
+        }
+        if (p1 != p2) {
+            int lo = start, hi = end;
+            while (lo < hi) {
+                int mid = lo + (hi - lo) / 2;
+                if (A->cidx[mid] < p1) lo = mid + 1; else hi = mid;
+            }
+            if (lo < end && A->cidx[lo] == p1 
+                    && transformed_value(A, entry_value(A, lo)) != 0) {
+                src = entry_value(A, lo);
+            }
+        }
+        if (A->hashed) {
+            if (old != 0) A->hash -= cell_hash(lr, c2, old);
+            if (src != 0) A->hash += cell_hash(lr, c2, 
+                                               transformed_value(A, src));
+        }
+        
+        // Rewrite the row with the destination cell replaced
+        A->rptr[m] = n;
+        int placed = (src == 0);
+        for (int i = start; i < end; i++) {
+            if (!placed && A->cidx[i] > p2) {
+                val_put(vals, w, n, src);
+                cidx[n] = p2;
+                n++;
+                placed = 1;
+            }
+            if (A->cidx[i] != p2) {
+                val_put(vals, w, n, entry_value(A, i));
+                cidx[n] = A->cidx[i];
+                n++;
+            }
+        }
+        if (!placed) {
+            val_put(vals, w, n, src);
+            cidx[n] = p2;
+            n++;
+        }
+        if (A->rid == NULL || A->rptr[m] != n) {
+            if (A->rid != NULL) A->rid[m] = row;
+            m++;
+        }
+    }
+    A->nrs = m;
+    A->rptr[m] = n;
+    A->nnz = n;
+    storage_swap(A, block, cap, w);
+    mem_free(A->rend);
+    A->rend = NULL;
+}
+
+// Copy physical column p1 over p2 (logical c2) using the column index,
+// visiting only the rows that hold an entry in either column. Rows with a
+// non-zero source get the source's stored value, and every other row
+// loses its destination entry.
+void op_copy_col_indexed(CSRMatrix_t *A, int p1, int p2, int c2) {
+    ColIndex_t *x = A->csc;
+    if (x->epoch == INT_MAX) {
+        memset(x->stamp, 0, sizeof(int) * A->rows);
+        x->epoch = 0;
+    }
+    x->epoch++;
+    for (int j = 0; p1 != p2 && j < x->len[p1]; j++) {
+        int p = x->rows[p1][j];
+        int src = entry_value(A, find_element_index(A, p, p1));
+        if (transformed_value(A, src) == 0) {
+            continue;
+        }
+        x->stamp[p] = x->epoch;
+        int idx = find_element_index(A, p, p2);
+        if (A->hashed) {
+            int lr = (A->rinv != NULL) ? A->rinv[p] : p;
+            int old = (idx != -1) 
+                      ? transformed_value(A, entry_value(A, idx)) : 0;
+            if (old != 0) A->hash -= cell_hash(lr, c2, old);
+            A->hash += cell_hash(lr, c2, transformed_value(A, src));
+        }
+        if (idx != -1) {
+            entry_store(A, idx, src);
+        } else {
+            entry_insert(A, p, p2, src);
+        }
+    }
+    // Removing an entry moves the column's last row into its place, so
+    // walk the list backwards
+    for (int j = x->len[p2] - 1; j >= 0; j--) {
+        int p = x->rows[p2][j];
+        if (x->stamp[p] == x->epoch) {
+            continue;
+        }
+        int idx = find_element_index(A, p, p2);
+        int old = transformed_value(A, entry_value(A, idx));
+        if (A->hashed && old != 0) {
+            A->hash -= cell_hash((A->rinv != NULL) ? A->rinv[p] : p, c2, old);
+        }
+        entry_remove(A, p, idx);
+    }
+}
+
+// Drop stored values that are zero under the pending transform from
+// physical row r
+void purge_row_zeros(CSRMatrix_t *A, int r) {
+    int k = row_slot(A, r);
+    if (k == -1) {
+        return;
+    }
+    csr_matrix_will_write(A);
+    if (A->csc != NULL) {
+        col_index_row(A, r, -1);
+    }
+    int n = A->rptr[k], end = row_end(A, k);
+    for (int i = A->rptr[k]; i < end; i++) {
+        if (transformed_value(A, entry_value(A, i)) != 0) {
+            entry_store(A, n, entry_value(A, i));
+            A->cidx[n] = A->cidx[i];
+            n++;
+        }
+    }
+    int delta = n - end;
+    if (A->csc != NULL) {
+        for (int i = A->rptr[k]; i < n; i++) {
+            col_index_add(A->csc, A->cidx[i], r);
+        }
+    }
+    if (delta != 0 && A->rend != NULL) {
+        A->rend[k] = n;
+        A->nnz += delta;
+        row_close(A, k);
+    } else if (delta != 0) {
+        PROF_SHIFT(A->nnz - end);
+        memmove(entry_vals(A, n), entry_vals(A, end), 
+                (size_t)A->vbytes * (A->nnz - end));
+        memmove(A->cidx + n, A->cidx + end, sizeof(int) * (A->nnz - end));
+        A->nnz += delta;
+        shift_rptr(A, k, delta);
+        row_close(A, k);
+    }
+}
+
+// Swap rows r1 and r2 lazily by exchanging their logical-to-physical map
+// entries. Stored zeros in either row are dropped, as the original
+// implementation did when it rebuilt both rows.
+void op_swap_row(CSRMatrix_t *A, int r1, int r2) {
+    assert(r1 >= 0 && r1 < A->rows && r2 >= 0 && r2 < A->rows);
+    if (r1 == r2) return;
+    if (A->rperm == NULL) {
+        A->rperm = identity_map(A->rows);
+        A->rinv = identity_map(A->rows);
+    }
+    int p1 = A->rperm[r1], p2 = A->rperm[r2];
+    if (A->hashed) {
+        hash_row(A, p1, r1, -1);
+        hash_row(A, p2, r2, -1);
+        hash_row(A, p1, r2, 1);
+        hash_row(A, p2, r1, 1);
+    }
+    A->rperm[r1] = p2;
+    A->rperm[r2] = p1;
+    A->rinv[p1] = r2;
+    A->rinv[p2] = r1;
+    if (A->zeros) {
+        purge_row_zeros(A, p1);
+        purge_row_zeros(A, p2);
+    }
+}
+
+// Swap columns c1 and c2 lazily by exchanging their map entries
+void op_swap_col(CSRMatrix_t *A, int c1, int c2) {
+    assert(c1 >= 0 && c1 < A->cols && c2 >= 0 && c2 < A->cols);
+    if (c1 == c2) return;
+    if (A->cperm == NULL) {
+        A->cperm = identity_map(A->cols);
+        A->cinv = identity_map(A->cols);
+    }
+    int p1 = A->cperm[c1], p2 = A->cperm[c2];
+    // The column index lists the cells of both columns; without it,
+    // finding them would cost a full scan. A column swap is a column
+    // instruction, so a lazy index is built now.
+    if (A->hashed && A->csc == NULL && A->use_csc) {
+        csr_matrix_index_cols(A);
+    }
+    if (A->hashed && A->csc != NULL) {
+        hash_col(A, p1, c1, c2);
+        hash_col(A, p2, c2, c1);
+    } else {
+        A->hashed = 0;
+    }
+    A->cperm[c1] = p2;
+    A->cperm[c2] = p1;
+    A->cinv[p1] = c2;
+    A->cinv[p2] = c1;
+}
+
+/* Instruction fusion --------------------------------------------------------*/
+
+// Read up to FUSE_WINDOW instructions into win, skipping empty lines as
+// main does. Sets *stop at an unknown opcode, which ends processing
+// without counting as a step, or at the end of input.
+int fuse_fill(Reader_t *in, Instr_t *win, int *stop) {
+    char *line;
+    int len, n = 0;
+    while (n < FUSE_WINDOW) {
+        if ((line = reader_line(in, &len)) == NULL) {
+            *stop = 1;
+            break;
+        }
+        if (len == 0) continue;
+        if (OPS[(unsigned char)line[0]].run == NULL) {
+            *stop = 1;
+            break;
+        }
+        Instr_t *x = &win[n++];
+        x->op = line[0];
+        memset(x->arg, 0, sizeof(x->arg));
+        if (len > 2) {
+            scan_ints(line + 2, line + len, x->arg, MAX_OP_ARGS);
+        }
+    }
+    return n;
+}
+
+// Check if set instruction x can be dropped because next writes the same
+// cell straight after it. Only the solved check in between could see the
+// value, and it can only succeed if the value is the target's.
+int fuse_overwritten(Instr_t *x, Instr_t *next, CSRMatrix_t *target) {
+    if (x->op != 's' || next->op != 's' || x->arg[0] != next->arg[0] 
+            || x->arg[1] != next->arg[1]) {
+        return 0;
+    }
+    int r = x->arg[0], c = x->arg[1];
+    return r >= 0 && r < target->rows && c >= 0 && c < target->cols 
+        && csr_matrix_get(target, r, c) != x->arg[2];
+}
+
+// Check if A and B certainly differ, by their entry counts or by a few
+// stored cells of A, without the full pass that a stale hash would need
+// after m:, a: or C:. Returns 0 if they may be equal.
+int csr_matrix_probe_differs(CSRMatrix_t *A, CSRMatrix_t *B) {
+    if (A->hashed && B->hashed) {
+        return A->hash != B->hash;
+    }
+    // Without a pending add, applying the transform keeps every entry
+    if (!A->drop && !B->drop && A->nnz != B->nnz) {
+        return 1;
+    }
+    for (int j = 0; j < FUSE_PROBES && A->nrs > 0; j++) {
+        int k = (int)((long)j * A->nrs / FUSE_PROBES);
+        if (A->rptr[k] == row_end(A, k)) continue;
+        int val = transformed_value(A, entry_value(A, A->rptr[k]));
+        // A zero may be stored or about to be dropped; neither proves much
+        if (val == 0) continue;
+        int p = slot_row(A, k), q = A->cidx[A->rptr[k]];
+        int r = (A->rinv != NULL) ? A->rinv[p] : p;
+        int c = (A->cinv != NULL) ? A->cinv[q] : q;
+        if (csr_matrix_get(B, r, c) != val) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Run the remaining instructions on current until it equals target, one
+// window at a time, counting steps in *steps. Instructions already run
+// lazily where they compose (m: and a: into one pending value transform,
+// R: and C: into pending permutations); here sets overwritten by the next
+// instruction are skipped, and the solved check after each step is
+// settled by csr_matrix_probe_differs whenever it can be. Returns 1 if
+// solved.
+int run_fused(Reader_t *in, CSRMatrix_t *current, CSRMatrix_t *target, 
+              int *steps) {
+    Instr_t win[FUSE_WINDOW];
+    int stop = 0;
+    while (!stop) {
+        PROF_BEGIN(PROF_PARSE);
+        int n = fuse_fill(in, win, &stop);
+        PROF_END(PROF_PARSE);
+        for (int i = 0; i < n; i++) {
+            (*steps)++;
+            if (i + 1 < n && fuse_overwritten(&win[i], &win[i + 1], target)) {
+                continue;
+            }
+            PROF_BEGIN(strchr(OPCODES, win[i].op) - OPCODES);
+            OPS[(unsigned char)win[i].op].run(current, win[i].arg);
+            PROF_END(strchr(OPCODES, win[i].op) - OPCODES);
+            PROF_PEAK(current);
+            CSR_CHECK(current);
+            if (csr_matrix_probe_differs(current, target)) {
+                continue;
+            }
+            PROF_BEGIN(PROF_EQUALS);
+            int solved = csr_matrix_equals(current, target);
+            PROF_END(PROF_EQUALS);
+            if (solved) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Input parsing -------------------------------------------------------------*/
+
+void run_set(CSRMatrix_t *A, int *arg) {
+    op_set(A, arg[0], arg[1], arg[2]);
+}
+
+void run_swap(CSRMatrix_t *A, int *arg) {
+    op_swap(A, arg[0], arg[1], arg[2], arg[3]);
+}
+
+void run_multiply(CSRMatrix_t *A, int *arg) {
+    op_multiply(A, arg[0]);
+}
+
+void run_add(CSRMatrix_t *A, int *arg) {
+    op_add(A, arg[0]);
+}
+
+void run_copy_row(CSRMatrix_t *A, int *arg) {
+    op_copy_row(A, arg[0], arg[1]);
+}
+
+void run_copy_col(CSRMatrix_t *A, int *arg) {
+    op_copy_col(A, arg[0], arg[1]);
+}
+
+void run_swap_row(CSRMatrix_t *A, int *arg) {
+    op_swap_row(A, arg[0], arg[1]);
+}
+
+void run_swap_col(CSRMatrix_t *A, int *arg) {
+    op_swap_col(A, arg[0], arg[1]);
+}
+
+// Open input stream fp, mapping it whole if it is a regular file and
+// otherwise buffering it block by block
+Reader_t* reader_create(FILE *fp) {
+    Reader_t *in = (Reader_t*)mem_alloc(sizeof(Reader_t));
+    assert(in != NULL);
+    in->fp = fp;
+    in->len = in->pos = 0;
+    in->eof = 0;
+    in->mapped = 0;
+#ifdef HAVE_MMAP
+    struct stat st;
+    if (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        off_t at = lseek(fileno(fp), 0, SEEK_CUR);
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, 
+                         fileno(fp), 0);
+        if (at >= 0 && map != MAP_FAILED) {
+            in->data = (char*)map;
+            in->cap = in->len = st.st_size;
+            in->pos = at;
+            in->eof = in->mapped = 1;
+            return in;
+        }
+    }
+#endif
+    in->cap = INPUT_BLOCK_SIZE;
+    in->data = (char*)mem_alloc(in->cap);
+    assert(in->data != NULL);
+    return in;
+}
+
+// Release the input mapping or buffer
+void reader_free(Reader_t *in) {
+#ifdef HAVE_MMAP
+    if (in->mapped) {
+        munmap(in->data, in->cap);
+        mem_free(in);
+        return;
+    }
+#endif
+    mem_free(in->data);
+    mem_free(in);
+}
+
+// Move unread bytes to the front of the buffer and read more after them;
+// returns 0 once the stream is exhausted
+int reader_fill(Reader_t *in) {
+    if (in->eof) return 0;
+    memmove(in->data, in->data + in->pos, in->len - in->pos);
+    in->len -= in->pos;
+    in->pos = 0;
+#ifdef HAVE_MMAP
+    long got = read(fileno(in->fp), in->data + in->len, in->cap - in->len);
+#else
+    long got = fread(in->data + in->len, 1, in->cap - in->len, in->fp);
+#endif
+    if (got <= 0) {
+        in->eof = 1;
+        return 0;
+    }
+    in->len += got;
+    return 1;
+}
+
+// Return the next line of input without its newline, or NULL at the end of
+// input. As with fgets into a MAX_LINE_LEN buffer, longer lines are returned
+// in pieces, and a line ends early at a null byte
+char* reader_line(Reader_t *in, int *len) {
+    char *line, *nl;
+    long avail;
+    for (;;) {
+        line = in->data + in->pos;
+        avail = in->len - in->pos;
+        if (avail > MAX_LINE_LEN - 1) avail = MAX_LINE_LEN - 1;
+        nl = (char*)memchr(line, '\n', avail);
+        if (nl != NULL || avail == MAX_LINE_LEN - 1 || !reader_fill(in)) break;
+    }
+    if (nl != NULL) {
+        *len = nl - line;
+        in->pos += *len + 1;
+    } else if (avail > 0) {
+        *len = avail;
+        in->pos += avail;
+    } else {
+        return NULL;
+    }
+    char *nul = (char*)memchr(line, '\0', *len);
+    if (nul != NULL) *len = nul - line;
+    return line;
+}
+
+// Parse an integer as "%d" would from p, stopping at end; returns the
+// position after it, or NULL if there are no digits
+const char* scan_int(const char *p, const char *end, int *val) {
+    while (p < end && (*p == ' ' || (unsigned)(*p - '\t') < 5)) p++;
+    int neg = (p < end && *p == '-');
+    if (p < end && (*p == '-' || *p == '+')) p++;
+    const char *start = p;
+    unsigned u = 0, d;
+    while (p < end && (d = (unsigned)(*p - '0')) < 10) {
+        u = u * 10 + d;
+        p++;
+    }
+    if (p == start) return NULL;
+    *val = (int)(neg ? 0u - u : u);
+    return p;
+}
+
+// Parse up to max comma-separated integers, as "%d,%d,..." would; returns
+// how many were parsed
+int scan_ints(const char *p, const char *end, int *vals, int max) {
+    int n = 0;
+    while (n < max && (p = scan_int(p, end, &vals[n])) != NULL) {
+        n++;
+        if (p >= end || *p != ',') break;
+        p++;
+    }
+    return n;
+}
+
+/* Output modes --------------------------------------------------------------*/
+
+// Select the output mode from "--output=MODE" or "-o MODE" on the command
+// line, falling back to the OUTPUT_ENV environment variable, then full
+OutputMode_t output_mode(int argc, char *argv[]) {
+    char *name = getenv(OUTPUT_ENV);
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--output=", 9) == 0) {
+            name = argv[i] + 9;
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            name = argv[++i];
+        }
+    }
+    if (name == NULL || strcmp(name, "full") == 0) {
+        return OUTPUT_FULL;
+    } else if (strcmp(name, "delta") == 0) {
+        return OUTPUT_DELTA;
+    } else if (strcmp(name, "summary") == 0) {
+        return OUTPUT_SUMMARY;
+    }
+    fprintf(stderr, "unknown output mode '%s' (full, delta, summary)\n", name);
+    exit(EXIT_FAILURE);
+}
+
+// Append cell (r,c)=val to a cell list
+void cell_list_push(CellList_t *list, int r, int c, int val) {
+    if (list->n >= list->cap) {
+        list->cap = (list->cap == 0) ? 1 : list->cap * GROWTH_FACTOR;
+        list->cells = (Cell_t*)mem_realloc(list->cells, 
+                                       sizeof(Cell_t) * list->cap);
+        assert(list->cells != NULL);
+    }
+    list->cells[list->n].r = r;
+    list->cells[list->n].c = c;
+    list->cells[list->n].val = val;
+    list->n++;
+}
+
+// Append the non-zero cells of logical row r
+void collect_row_cells(CSRMatrix_t *A, int r, CellList_t *list) {
+    int lo, hi;
+    row_bounds(A, (A->rperm != NULL) ? A->rperm[r] : r, &lo, &hi);
+    for (int i = lo; i < hi; i++) {
+        int val = transformed_value(A, entry_value(A, i));
+        if (val != 0) {
+            int c = (A->cinv != NULL) ? A->cinv[A->cidx[i]] : A->cidx[i];
+            cell_list_push(list, r, c, val);
+        }
+    }
+}
+
+// Append the non-zero cells of logical column c, visiting the rows the
+// column index lists for it, or every stored row when it is off
+void collect_col_cells(CSRMatrix_t *A, int c, CellList_t *list) {
+    if (A->csc == NULL && A->use_csc) {
+        csr_matrix_index_cols(A);
+    }
+    int pc = (A->cperm != NULL) ? A->cperm[c] : c;
+    int n = (A->csc != NULL) ? A->csc->len[pc] : A->nrs;
+    for (int k = 0; k < n; k++) {
+        int p = (A->csc != NULL) ? A->csc->rows[pc][k] : slot_row(A, k);
+        int idx = find_element_index(A, p, pc);
+        if (idx != -1 && transformed_value(A, entry_value(A, idx)) != 0) {
+            cell_list_push(list, (A->rinv != NULL) ? A->rinv[p] : p, c,
+                           transformed_value(A, entry_value(A, idx)));
+        }
+    }
+}
+
+// Compare cells in row-major order, for qsort
+int compare_cells(const void *a, const void *b) {
+    const Cell_t *x = (const Cell_t*)a, *y = (const Cell_t*)b;
+    if (x->r != y->r) return (x->r > y->r) - (x->r < y->r);
+    return (x->c > y->c) - (x->c < y->c);
+}
+
+// Collect the non-zero cells that instruction op with arguments arg can
+// change, sorted in row-major order without duplicates
+void collect_region(CSRMatrix_t *A, char op, int *arg, CellList_t *list) {
+    list->n = 0;
+    if (op == 's' || op == 'S') {
+        for (int j = 0; j < ((op == 's') ? 2 : 4); j += 2) {
+            int val = csr_matrix_get(A, arg[j], arg[j + 1]);
+            if (val != 0) cell_list_push(list, arg[j], arg[j + 1], val);
+        }
+    } else if (op == 'r') {
+        collect_row_cells(A, arg[1], list);
+    } else if (op == 'R') {
+        collect_row_cells(A, arg[0], list);
+        if (arg[1] != arg[0]) collect_row_cells(A, arg[1], list);
+    } else if (op == 'c') {
+        collect_col_cells(A, arg[1], list);
+    } else if (op == 'C') {
+        collect_col_cells(A, arg[0], list);
+        if (arg[1] != arg[0]) collect_col_cells(A, arg[1], list);
+    } else if (op == 'm' || op == 'a') {
+        for (int k = 0; k < A->nrs; k++) {
+            int p = slot_row(A, k);
+            collect_row_cells(A, (A->rinv != NULL) ? A->rinv[p] : p, list);
+        }
+    }
+    qsort(list->cells, list->n, sizeof(Cell_t), compare_cells);
+    int n = 0;
+    for (int i = 0; i < list->n; i++) {
+        if (n == 0 || compare_cells(&list->cells[n - 1], &list->cells[i])) {
+            list->cells[n++] = list->cells[i];
+        }
+    }
+    list->n = n;
+}
+
+// Print the cells whose value differs between two sorted cell lists, with
+// their new value (0 once cleared), and the resulting nnz
+void print_delta(Writer_t *out, CellList_t *before, CellList_t *after, 
+                 int nnz) {
+    int changed = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        int i = 0, j = 0;
+        while (i < before->n || j < after->n) {
+            int cmp = (i == before->n) ? 1 : (j == after->n) ? -1 
+                    : compare_cells(&before->cells[i], &after->cells[j]);
+            Cell_t *cell = (cmp < 0) ? &before->cells[i] : &after->cells[j];
+            int val = (cmp < 0) ? 0 : after->cells[j].val;
+            if (cmp != 0 || before->cells[i].val != val) {
+                if (pass == 0) {
+                    changed++;
+                } else {
+                    write_fmt(out, "(%d,%d)=%d\n", cell->r, cell->c, val);
+                }
+            }
+            i += (cmp <= 0);
+            j += (cmp >= 0);
+        }
+        if (pass == 0) {
+            write_fmt(out, "Changed cells: %d, nnz=%d\n", changed, nnz);
+        }
+    }
+}
+
+/* Buffered output -----------------------------------------------------------*/
+
+// Create a writer that buffers output for stream fp
+Writer_t* writer_create(FILE *fp) {
+    Writer_t *out = (Writer_t*)mem_alloc(sizeof(Writer_t));
+    assert(out != NULL);
+    out->fp = fp;
+    out->len = 0;
+    out->cap = (fp != NULL) ? OUTPUT_BUF_SIZE : MEM_BUF_SIZE;
+    out->buf = (char*)mem_alloc(out->cap);
+    assert(out->buf != NULL);
+    return out;
+}
+
+// Flush pending output and free the writer
+void writer_free(Writer_t *out) {
+    writer_flush(out);
+    if (out->fp != NULL) {
+        fflush(out->fp);
+    }
+    mem_free(out->buf);
+    mem_free(out);
+}
+
+// Write out all pending bytes in a single fwrite
+void writer_flush(Writer_t *out) {
+    if (out->len > 0 && out->fp != NULL) {
+        fwrite(out->buf, 1, out->len, out->fp);
+        out->len = 0;
+    }
+}
+
+// Make room for n more bytes, returning where they go; the caller appends
+// them and advances len
+char* writer_space(Writer_t *out, int n) {
+    if (out->len + n > out->cap) {
+        writer_flush(out);
+        if (out->fp == NULL) {
+            assert(out->cap <= INT_MAX / GROWTH_FACTOR - n);
+            out->cap = out->cap * GROWTH_FACTOR + n;
+            out->buf = (char*)mem_realloc(out->buf, out->cap);
+        } else if (n > out->cap) {
+            out->cap = n;
+            out->buf = (char*)mem_realloc(out->buf, out->cap);
+            assert(out->buf != NULL);
+        }
+    }
+    return out->buf + out->len;
+}
+
+// Append string s
+void write_str(Writer_t *out, const char *s) {
+    int n = (int)strlen(s);
+    memcpy(writer_space(out, n), s, n);
+    out->len += n;
+}
+
+// Append n bytes from s; a block larger than half the buffer is written
+// straight to the stream
+void write_bytes(Writer_t *out, const char *s, int n) {
+    if (out->fp != NULL && n > out->cap / 2) {
+        writer_flush(out);
+        fwrite(s, 1, n, out->fp);
+        return;
+    }
+    memcpy(writer_space(out, n), s, n);
+    out->len += n;
+}
+
+// Append val in decimal, converting digits by hand
+void write_int(Writer_t *out, int val) {
+    char digits[MAX_INT_CHARS];
+    char *p = writer_space(out, MAX_INT_CHARS);
+    unsigned u = (val < 0) ? 0u - (unsigned)val : (unsigned)val;
+    int n = 0;
+    do {
+        digits[n++] = (char)('0' + u % 10);
+        u /= 10;
+    } while (u > 0);
+    if (val < 0) {
+        *p++ = '-';
+        out->len++;
+    }
+    for (int i = 0; i < n; i++) {
+        p[i] = digits[n - 1 - i];
+    }
+    out->len += n;
+}
+
+// Append printf-style formatted text, for the less frequent output lines
+void write_fmt(Writer_t *out, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    char *p = writer_space(out, n + 1);
+    va_start(args, fmt);
+    vsnprintf(p, n + 1, fmt, args);
+    va_end(args);
+    out->len += n;
+}
+
+// Print solution message and cleanup matrices
+void print_solution_and_cleanup(Writer_t *out, CSRMatrix_t* initial, 
+                                CSRMatrix_t* target, CSRMatrix_t* current, 
+                                int step_count) {
+    write_str(out, DELIMITER "\n");
+    write_fmt(out, "TA-DAA!!! SOLVED IN %d STEP(S)!\n", step_count);
+    write_str(out, THEEND);
+    csr_matrix_free(initial);
+    csr_matrix_free(target);
+    csr_matrix_free(current);
+    mem_pool_free();
+}
+
+// Cleanup matrices without printing solution message
+void cleanup_matrices(CSRMatrix_t* initial, CSRMatrix_t* target, 
+                      CSRMatrix_t* current) {
+    csr_matrix_free(initial);
+    csr_matrix_free(target);
+    csr_matrix_free(current);
+    mem_pool_free();
+}
+
+/* Binary snapshots ----------------------------------------------------------*/
+
+// Lay out the sections of a snapshot with the counts given in h, filling
+// in their offsets; returns the size of the whole file
+long long snap_layout(SnapHeader_t *h) {
+    long long len[SNAP_SECTIONS] = {
+        h->nrs + 1L, h->dcsr ? h->nrs : 0, h->nnz, h->nnz, h->pord ? h->nnz : 0
+    };
+    long long at = sizeof(SnapHeader_t);
+    for (int s = 0; s < SNAP_SECTIONS; s++) {
+        at = (at + SNAP_ALIGN - 1) & ~(long long)(SNAP_ALIGN - 1);
+        h->off[s] = at;
+        at += sizeof(int) * len[s];
+    }
+    return at;
+}
+
+// Mix n ints into checksum h, 32 bits at a time as in FNV-1a
+unsigned long long snap_checksum(unsigned long long h, const int *v, int n) {
+    for (int i = 0; i < n; i++) {
+        h = (h ^ (unsigned)v[i]) * 0x100000001B3ULL;
+    }
+    return h;
+}
+
+// Write matrix A to a snapshot file at path, first bringing it to packed
+// form with int values; returns 0 if the file cannot be written
+int snap_save(const char *path, CSRMatrix_t *A) {
+    csr_matrix_apply(A);
+    csr_matrix_materialize(A);
+    csr_matrix_pack(A);
+    csr_matrix_rewidth(A, sizeof(int));
+    SnapHeader_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAP_MAGIC, sizeof(SNAP_MAGIC));
+    h.version = SNAP_VERSION;
+    h.rows = A->rows;
+    h.cols = A->cols;
+    h.nnz = A->nnz;
+    h.nrs = A->nrs;
+    h.dcsr = (A->rid != NULL);
+    h.zeros = A->zeros;
+    h.pord = (A->pord != NULL);
+    h.hash = csr_matrix_hash(A);
+    snap_layout(&h);
+    const int *sec[SNAP_SECTIONS] = {A->rptr, A->rid, (int*)A->vals, 
+                                     A->cidx, A->pord};
+    int len[SNAP_SECTIONS] = {A->nrs + 1, h.dcsr ? A->nrs : 0, A->nnz, A->nnz,
+                              h.pord ? A->nnz : 0};
+    h.checksum = 0xCBF29CE484222325ULL;
+    for (int s = 0; s < SNAP_SECTIONS; s++) {
+        h.checksum = snap_checksum(h.checksum, sec[s], len[s]);
+    }
+    
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+        return 0;
+    }
+    static const char pad[SNAP_ALIGN];
+    int ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+    long long at = sizeof(h);
+    for (int s = 0; s < SNAP_SECTIONS && ok; s++) {
+        ok = fwrite(pad, 1, h.off[s] - at, fp) == (size_t)(h.off[s] - at)
+          && (len[s] == 0 
+              || fwrite(sec[s], sizeof(int), len[s], fp) == (size_t)len[s]);
+        at = h.off[s] + sizeof(int) * (long long)len[s];
+    }
+    return (fclose(fp) == 0) && ok;
+}
+
+// Load the rows x cols matrix stored in the snapshot file at path. The
+// file is mapped read-only and the matrix uses its arrays in place, so
+// loading costs a checksum pass, a pass to check the rows against the
+// header and its hash, and no copy. Such a matrix must not be changed;
+// csr_matrix_copy gives a changeable one. A trusted
+// file, one this process has just written, skips the checksum and the
+// checks, so loading it reads none of its sections.
+CSRMatrix_t* snap_load(const char *path, int rows, int cols, int trusted) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        snap_fail(path, "cannot open it");
+    }
+    SnapHeader_t h;
+    char *data = NULL;
+    long size = 0;
+#ifdef HAVE_MMAP
+    struct stat st;
+    int ok = fstat(fileno(fp), &st) == 0 && st.st_size >= (long)sizeof(h);
+    void *map = ok ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, 
+                          fileno(fp), 0) : MAP_FAILED;
+    if (map == MAP_FAILED) {
+        snap_fail(path, "cannot map it");
+    }
+    data = (char*)map;
+    size = st.st_size;
+#else
+    // Without mappings the file is read into memory whole
+    long cap = INITIAL_CAPACITY;
+    while (!feof(fp) && !ferror(fp)) {
+        cap = (cap == 0) ? INPUT_BLOCK_SIZE : cap * GROWTH_FACTOR;
+        data = (char*)mem_realloc(data, cap);
+        size += fread(data + size, 1, cap - size, fp);
+    }
+#endif
+    fclose(fp);
+    
+    // The header must describe this matrix and match the file's layout
+    if (size < (long)sizeof(h) 
+            || memcmp(data, SNAP_MAGIC, sizeof(SNAP_MAGIC)) != 0) {
+        snap_fail(path, "not a snapshot");
+    }
+    memcpy(&h, data, sizeof(h));
+    if (h.version != SNAP_VERSION) {
+        snap_fail(path, "version %d, expected %d", h.version, SNAP_VERSION);
+    }
+    if (h.rows != rows || h.cols != cols) {
+        snap_fail(path, "holds a %dx%d matrix, expected %dx%d", 
+                  h.rows, h.cols, rows, cols);
+    }
+    SnapHeader_t want = h;
+    if (h.nnz < 0 || h.nrs < 0 || h.nrs > rows 
+            || (h.dcsr != 0 && h.dcsr != 1) || (!h.dcsr && h.nrs != rows)
+            || (h.pord != 0 && h.pord != 1)
+            || snap_layout(&want) != size 
+            || memcmp(want.off, h.off, sizeof(h.off)) != 0) {
+        snap_fail(path, "header does not match its layout");
+    }
+    
+    CSRMatrix_t *A = csr_matrix_create(rows, cols);
+    mem_free(A->rptr);
+    mem_free(A->rid);
+    A->snap = data;
+    A->snap_len = size;
+    A->rptr = (int*)(data + h.off[0]);
+    A->rid = h.dcsr ? (int*)(data + h.off[1]) : NULL;
+    A->vals = data + h.off[2];
+    A->vbytes = sizeof(int);
+    A->cidx = (int*)(data + h.off[3]);
+    A->pord = h.pord ? (int*)(data + h.off[4]) : NULL;
+    A->nnz = A->cap = h.nnz;
+    A->nrs = h.nrs;
+    A->rcap = h.nrs + 1;
+    A->zeros = h.zeros;
+    A->vlo = INT_MIN;
+    A->vhi = INT_MAX;
+    A->hash = h.hash;
+    A->hashed = 1;
+    if (trusted) {
+        CSR_CHECK(A);
+        return A;
+    }
+    unsigned long long sum = 0xCBF29CE484222325ULL;
+    sum = snap_checksum(sum, A->rptr, A->nrs + 1);
+    sum = snap_checksum(sum, A->rid, h.dcsr ? A->nrs : 0);
+    sum = snap_checksum(sum, (int*)A->vals, A->nnz);
+    sum = snap_checksum(sum, A->cidx, A->nnz);
+    sum = snap_checksum(sum, A->pord, h.pord ? A->nnz : 0);
+    if (sum != h.checksum) {
+        snap_fail(path, "checksum mismatch");
+    }
+    if (!snap_valid(A)) {
+        snap_fail(path, "malformed rows");
+    }
+    // The checksum covers the sections only, so the header's hash is
+    // recomputed from them rather than taken as given
+    A->hashed = 0;
+    if (csr_matrix_hash(A) != h.hash) {
+        snap_fail(path, "hash does not match its cells");
+    }
+    CSR_CHECK(A);
+    return A;
+}
+
+// Load the snapshot that a matrix line of len bytes names after its
+// SNAP_PREFIX
+CSRMatrix_t* snap_line_load(char *line, int len, int rows, int cols) {
+    char path[MAX_LINE_LEN];
+    while (len > 1 && (line[len - 1] == '\r' || line[len - 1] == ' ')) {
+        len--;
+    }
+    memcpy(path, line + 1, len - 1);
+    path[len - 1] = '\0';
+    return snap_load(path, rows, cols, 0);
+}
+
+// Report that the snapshot file at path cannot be loaded, and exit
+void snap_fail(const char *path, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "cannot load snapshot %s: ", path);
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+    exit(EXIT_FAILURE);
+}
+
+// Check that the arrays of a loaded snapshot A stay within themselves:
+// row pointers run from 0 to nnz without decreasing, stored rows ascend
+// within range and are non-empty, column indices strictly increase within
+// range in each row, values are non-zero unless A says they may be, and
+// input-order ranks permute each row. Unlike csr_matrix_check this runs
+// in every build, as the file comes from outside the program.
+int snap_valid(CSRMatrix_t *A) {
+    if (A->rptr[0] != 0 || A->rptr[A->nrs] != A->nnz) {
+        return 0;
+    }
+    for (int k = 0; k < A->nrs; k++) {
+        int start = A->rptr[k], end = A->rptr[k + 1];
+        if (start > end || (A->rid != NULL && (start == end 
+                || A->rid[k] < 0 || A->rid[k] >= A->rows
+                || (k > 0 && A->rid[k - 1] >= A->rid[k])))) {
+            return 0;
+        }
+        for (int i = start; i < end; i++) {
+            if (A->cidx[i] < 0 || A->cidx[i] >= A->cols
+                    || (i > start && A->cidx[i - 1] >= A->cidx[i])
+                    || (!A->zeros && entry_value(A, i) == 0)) {
+                return 0;
+            }
+        }
+    }
+    // Input-order ranks must number each row's entries from 0, once each
+    int ok = 1;
+    if (A->pord != NULL) {
+        long mark = scratch_mark();
+        scratch_reserve(A->nnz + SCRATCH_ALIGN);
+        char *seen = (char*)scratch_alloc(A->nnz);
+        memset(seen, 0, A->nnz);
+        for (int k = 0; k < A->nrs && ok; k++) {
+            int start = A->rptr[k], end = A->rptr[k + 1];
+            for (int i = start; i < end && ok; i++) {
+                int rank = A->pord[i];
+                ok = rank >= 0 && rank < end - start && !seen[start + rank]++;
+            }
+        }
+        scratch_release(mark);
+    }
+    return ok;
+}
+
+// Release the memory holding a loaded snapshot file of len bytes
+void snap_unmap(char *data, long len) {
+#ifdef HAVE_MMAP
+    munmap(data, len);
+#else
+    (void)len;
+    mem_free(data);
+#endif
+}
+
+// Read the dimensions and both matrices of a text input, and write the
+// initial matrix to initial_path and the target matrix to target_path,
+// skipping either path if it is NULL
+int convert_input(Reader_t *in, char *initial_path, char *target_path) {
+    int rows = 0, cols = 0, status = EXIT_SUCCESS;
+    read_dims(in, &rows, &cols);
+    CSRMatrix_t *A[2];
+    char *path[2] = {initial_path, target_path};
+    A[0] = csr_matrix_read(in, rows, cols);
+    A[1] = csr_matrix_read(in, rows, cols);
+    for (int i = 0; i < 2; i++) {
+        if (path[i] != NULL && !snap_save(path[i], A[i])) {
+            fprintf(stderr, "cannot write %s\n", path[i]);
+            status = EXIT_FAILURE;
+        }
+        csr_matrix_free(A[i]);
+    }
+    return status;
+}
+
+// Read the spill directory from --spill=DIR, else SPILL_ENV; NULL if
+// neither is given
+char* spill_config(int argc, char *argv[]) {
+    char *dir = getenv(SPILL_ENV);
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--spill=", 8) == 0) {
+            dir = argv[i] + 8;
+        }
+    }
+    return (dir != NULL && dir[0] != '\0') ? dir : NULL;
+}
+
+#ifdef HAVE_MMAP
+// Create a file in dir for reading and writing, named after SPILL_NAME.
+// Its name is returned in *path, for the caller to free; if path is NULL
+// the file is unlinked at once, to go away when closed. Returns NULL if
+// the file cannot be created.
+FILE* spill_open(const char *dir, char **path) {
+    size_t len = strlen(dir) + sizeof(SPILL_NAME);
+    char *name = (char*)mem_alloc(len);
+    snprintf(name, len, "%s" SPILL_NAME, dir);
+    int fd = mkstemp(name);
+    FILE *fp = (fd >= 0) ? fdopen(fd, "w+b") : NULL;
+    if (fp == NULL) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(name);
+        }
+        mem_free(name);
+        return NULL;
+    }
+    if (path != NULL) {
+        *path = name;
+    } else {
+        unlink(name);
+        mem_free(name);
+    }
+    return fp;
+}
+
+// Add cell x to block b, writing the block's buffer to tmp as chunk
+// number *written when it is full
+void spill_block_add(SpillBlock_t *b, FILE *tmp, int *written, Cell_t x) {
+    if (b->buf == NULL) {
+        b->buf = (Cell_t*)mem_alloc(sizeof(Cell_t) * SPILL_CHUNK);
+    }
+    if (b->n == SPILL_CHUNK) {
+        if (b->nchunks == b->cap) {
+            b->cap = (b->cap == 0) ? 1 : b->cap * GROWTH_FACTOR;
+            b->chunks = (int*)mem_realloc(b->chunks, sizeof(int) * b->cap);
+        }
+        // Chunks are only appended, so chunk k starts at k full chunks
+        b->chunks[b->nchunks++] = (*written)++;
+        fwrite(b->buf, sizeof(Cell_t), SPILL_CHUNK, tmp);
+        b->n = 0;
+    }
+    b->buf[b->n++] = x;
+}
+
+// Append n ints from the start of src to fp, mixing them into checksum
+// *sum; returns 0 if they cannot be copied
+int spill_copy(FILE *fp, FILE *src, int n, unsigned long long *sum) {
+    int buf[SPILL_CHUNK];
+    rewind(src);
+    while (n > 0) {
+        int m = (n < SPILL_CHUNK) ? n : SPILL_CHUNK;
+        if (fread(buf, sizeof(int), m, src) != (size_t)m 
+                || fwrite(buf, sizeof(int), m, fp) != (size_t)m) {
+            return 0;
+        }
+        *sum = snap_checksum(*sum, buf, m);
+        n -= m;
+    }
+    return 1;
+}
+#endif
+
+// Read a matrix from input straight into a snapshot file in dir, and
+// return the file's mapping in its place. Cells are sorted into
+// SPILL_BLOCKS blocks of rows through a temporary file; each block is then
+// built on its own and its rows streamed out, so memory holds one block
+// and a count per row rather than the whole matrix. The kernel pages the
+// rows in as they are read and evicts the least recently used ones under
+// memory pressure. The file is unlinked once mapped, so it goes away with
+// the matrix. A section naming a snapshot loads that file instead, and
+// without a directory, or a file in it, the matrix is read into memory.
+CSRMatrix_t* spill_read(Reader_t *in, int rows, int cols, const char *dir) {
+#ifdef HAVE_MMAP
+    if (dir == NULL) {
+        return csr_matrix_read(in, rows, cols);
+    }
+    // Temporary files for the cells and for the values, column indices
+    // and input-order ranks of the built rows
+    FILE *tmp[4];
+    int opened = 0;
+    while (opened < 4 && (tmp[opened] = spill_open(dir, NULL)) != NULL) {
+        opened++;
+    }
+    char *path = NULL;
+    FILE *fp = (opened == 4) ? spill_open(dir, &path) : NULL;
+    if (fp == NULL) {
+        fprintf(stderr, "cannot write spill file in %s\n", dir);
+        while (opened > 0) {
+            fclose(tmp[--opened]);
+        }
+        return csr_matrix_read(in, rows, cols);
+    }
+    PROF_BEGIN(PROF_READ);
+    int span = (rows + SPILL_BLOCKS - 1) / SPILL_BLOCKS;
+    span = (span > 0) ? span : 1;
+    int nblocks = (rows + span - 1) / span;
+    SpillBlock_t *block = (SpillBlock_t*)mem_alloc(
+        sizeof(SpillBlock_t) * (nblocks > 0 ? nblocks : 1));
+    memset(block, 0, sizeof(SpillBlock_t) * (nblocks > 0 ? nblocks : 1));
+    CSRMatrix_t *snap = NULL;
+    char *line;
+    int len, n = 0, written = 0;
+    while ((line = reader_line(in, &len)) != NULL) {
+        if (len == 0) continue;
+        if (line[0] == '#') break;
+        
+        if (line[0] == SNAP_PREFIX && n == 0 && snap == NULL) {
+            snap = snap_line_load(line, len, rows, cols);
+            continue;
+        }
+        assert(snap == NULL);
+        int rcv[3];
+        if (scan_ints(line, line + len, rcv, 3) == 3) {
+            Cell_t x = {rcv[0], rcv[1], rcv[2]};
+            assert(x.r >= 0 && x.r < rows && x.c >= 0 && x.c < cols);
+            spill_block_add(&block[x.r / span], tmp[0], &written, x);
+            n++;
+        }
+    }
+    if (snap != NULL) {
+        for (int t = 0; t < 4; t++) {
+            fclose(tmp[t]);
+        }
+        fclose(fp);
+        unlink(path);
+        mem_free(path);
+        mem_free(block);
+        PROF_END(PROF_READ);
+        return snap;
+    }
+    
+    // Build each block from its cells in input order, and stream out its
+    // rows; rptr counts the entries of every row
+    int *rptr = (int*)mem_alloc(sizeof(int) * (rows + 1L));
+    memset(rptr, 0, sizeof(int) * (rows + 1L));
+    int nnz = 0, ranked = 0, ok = 1;
+    unsigned long long hash = 0;
+    for (int b = 0; b < nblocks; b++) {
+        SpillBlock_t *blk = &block[b];
+        int r0 = b * span, nb = blk->nchunks * SPILL_CHUNK + blk->n;
+        int *ri = (int*)mem_alloc(sizeof(int) * (nb > 0 ? nb : 1));
+        int *ci = (int*)mem_alloc(sizeof(int) * (nb > 0 ? nb : 1));
+        int *vi = (int*)mem_alloc(sizeof(int) * (nb > 0 ? nb : 1));
+        // The cells still buffered come last, and are taken first, as
+        // the buffer is reused to read the chunks back
+        for (int j = blk->nchunks; j >= 0; j--) {
+            int m = (j < blk->nchunks) ? SPILL_CHUNK : blk->n;
+            if (j < blk->nchunks) {
+                ok &= fseeko(tmp[0], (off_t)blk->chunks[j] * SPILL_CHUNK 
+                                     * sizeof(Cell_t), SEEK_SET) == 0
+                   && fread(blk->buf, sizeof(Cell_t), m, tmp[0]) == (size_t)m;
+            }
+            for (int i = 0, at = j * SPILL_CHUNK; i < m; i++, at++) {
+                ri[at] = blk->buf[i].r - r0;
+                ci[at] = blk->buf[i].c;
+                vi[at] = blk->buf[i].val;
+            }
+        }
+        int brows = (r0 + span < rows) ? span : rows - r0;
+        CSRMatrix_t *B = csr_matrix_build(brows, cols, nb, ri, ci, vi);
+        mem_free(ri);
+        mem_free(ci);
+        mem_free(vi);
+        // Built rows are packed in row order, with ranks only if needed;
+        // the file holds int values
+        csr_matrix_rewidth(B, sizeof(int));
+        ok &= B->nnz == 0 
+           || (fwrite(B->vals, sizeof(int), B->nnz, tmp[1]) == (size_t)B->nnz
+               && fwrite(B->cidx, sizeof(int), B->nnz, tmp[2]) 
+                  == (size_t)B->nnz);
+        for (int k = 0; k < B->nrs; k++) {
+            int r = r0 + slot_row(B, k);
+            for (int i = B->rptr[k]; i < B->rptr[k + 1]; i++) {
+                int rank = (B->pord != NULL) ? B->pord[i] : i - B->rptr[k];
+                ok &= fwrite(&rank, sizeof(int), 1, tmp[3]) == 1;
+                hash += cell_hash(r, B->cidx[i], entry_value(B, i));
+            }
+            rptr[r + 1] = B->rptr[k + 1] - B->rptr[k];
+        }
+        nnz += B->nnz;
+        ranked |= (B->pord != NULL);
+        csr_matrix_free(B);
+    }
+    for (int b = 0; b < nblocks; b++) {
+        mem_free(block[b].buf);
+        mem_free(block[b].chunks);
+    }
+    mem_free(block);
+    
+    // Store the rows in the layout csr_matrix_pick_layout would choose,
+    // then write the sections at their offsets and the header last
+    SnapHeader_t h;
+    memset(&h, 0, sizeof(h));
+    int nonempty = 0, *rid = NULL;
+    for (int r = 0; r < rows; r++) {
+        nonempty += (rptr[r + 1] != 0);
+    }
+    h.dcsr = (nonempty * HYPERSPARSE_RATIO <= rows);
+    if (h.dcsr) {
+        rid = (int*)mem_alloc(sizeof(int) * (nonempty > 0 ? nonempty : 1));
+    }
+    int k = 0;
+    for (int r = 0; r < rows; r++) {
+        if (!h.dcsr || rptr[r + 1] != 0) {
+            if (h.dcsr) rid[k] = r;
+            rptr[k + 1] = rptr[k] + rptr[r + 1];
+            k++;
+        }
+    }
+    memcpy(h.magic, SNAP_MAGIC, sizeof(SNAP_MAGIC));
+    h.version = SNAP_VERSION;
+    h.rows = rows;
+    h.cols = cols;
+    h.nnz = nnz;
+    h.nrs = k;
+    h.pord = ranked;
+    h.hash = hash;
+    long long size = snap_layout(&h);
+    h.checksum = 0xCBF29CE484222325ULL;
+    for (int s = 0; s < SNAP_SECTIONS; s++) {
+        ok &= fseeko(fp, (off_t)h.off[s], SEEK_SET) == 0;
+        if (s == 0 || s == 1) {
+            int m = (s == 0) ? h.nrs + 1 : (h.dcsr ? h.nrs : 0);
+            int *v = (s == 0) ? rptr : rid;
+            ok &= m == 0 || fwrite(v, sizeof(int), m, fp) == (size_t)m;
+            h.checksum = snap_checksum(h.checksum, v, m);
+        } else if (s < 4 || h.pord) {
+            fflush(tmp[s - 1]);
+            ok &= spill_copy(fp, tmp[s - 1], nnz, &h.checksum);
+        }
+    }
+    mem_free(rptr);
+    mem_free(rid);
+    ok &= fseeko(fp, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, fp) == 1
+       && fflush(fp) == 0 && ftruncate(fileno(fp), (off_t)size) == 0;
+    for (int t = 0; t < 4; t++) {
+        ok &= !ferror(tmp[t]);
+        fclose(tmp[t]);
+    }
+    ok &= fclose(fp) == 0;
+    if (!ok) {
+        fprintf(stderr, "cannot write spill file in %s\n", dir);
+        unlink(path);
+        exit(EXIT_FAILURE);
+    }
+    snap = snap_load(path, rows, cols, 1);
+    unlink(path);
+    mem_free(path);
+    mem_pool_free();
+    PROF_END(PROF_READ);
+    return snap;
+#else
+    // Without mappings a spilled matrix would be read back into memory
+    (void)dir;
+    return csr_matrix_read(in, rows, cols);
+#endif
+}
+
+/* Batch processing ----------------------------------------------------------*/
+
+// Read the batch settings: --batch=PATH names a directory of inputs or a
+// manifest file, --batch-out=DIR writes each output to its own file, and
+// --batch-threads=N sets the worker count (all cores by default)
+void batch_config(int argc, char *argv[], BatchConfig_t *cfg) {
+    cfg->path = NULL;
+    cfg->out_dir = NULL;
+    cfg->threads = 1;
+#ifdef HAVE_THREADS
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    cfg->threads = (cores > 0) ? (int)cores : 1;
+#endif
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--batch=", 8) == 0) {
+            cfg->path = argv[i] + 8;
+        } else if (strncmp(argv[i], "--batch-out=", 12) == 0) {
+            cfg->out_dir = argv[i] + 12;
+        } else if (strncmp(argv[i], "--batch-threads=", 16) == 0) {
+            cfg->threads = atoi(argv[i] + 16);
+        }
+    }
+    if (cfg->threads < 1) cfg->threads = 1;
+    if (cfg->threads > MAX_THREADS) cfg->threads = MAX_THREADS;
+}
+
+// Compare two strings, for qsort
+int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// List the inputs named by path into *paths, returning how many there
+// are, or -1 if path cannot be read. A directory gives its regular files
+// in name order; any other file is a manifest of input paths, one per
+// line, where empty lines and lines starting with '#' are skipped.
+int batch_list(const char *path, char ***paths) {
+    int n = 0, cap = INITIAL_CAPACITY;
+    char **list = NULL;
+#ifdef HAVE_DIRENT
+    DIR *dir = opendir(path);
+    if (dir != NULL) {
+        struct dirent *e;
+        while ((e = readdir(dir)) != NULL) {
+            if (e->d_name[0] == '.') continue;
+            size_t len = strlen(path) + strlen(e->d_name) + 2;
+            char *name = (char*)mem_alloc(len);
+            snprintf(name, len, "%s/%s", path, e->d_name);
+            struct stat st;
+            if (stat(name, &st) != 0 || !S_ISREG(st.st_mode)) {
+                mem_free(name);
+                continue;
+            }
+            if (n >= cap) {
+                cap = (cap == 0) ? 16 : cap * GROWTH_FACTOR;
+                list = (char**)mem_realloc(list, sizeof(char*) * cap);
+            }
+            list[n++] = name;
+        }
+        closedir(dir);
+        qsort(list, n, sizeof(char*), compare_strings);
+        *paths = list;
+        return n;
+    }
+#endif
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    Reader_t *in = reader_create(fp);
+    char *line;
+    int len;
+    while ((line = reader_line(in, &len)) != NULL) {
+        while (len > 0 && (line[len - 1] == '\r' || line[len - 1] == ' ')) {
+            len--;
+        }
+        if (len == 0 || line[0] == '#') continue;
+        if (n >= cap) {
+            cap = (cap == 0) ? 16 : cap * GROWTH_FACTOR;
+            list = (char**)mem_realloc(list, sizeof(char*) * cap);
+        }
+        list[n] = (char*)mem_alloc(len + 1);
+        memcpy(list[n], line, len);
+        list[n++][len] = '\0';
+    }
+    reader_free(in);
+    fclose(fp);
+    *paths = list;
+    return n;
+}
+
+// Run input i, writing its output to its own file or holding it until it
+// is next in order on stdout
+void batch_run_one(Batch_t *B, int i) {
+    char *path = B->paths[i];
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "cannot open %s\n", path);
+    }
+    Writer_t *out = NULL;
+    FILE *dst = NULL;
+    if (B->cfg->out_dir != NULL) {
+        const char *base = strrchr(path, '/');
+        base = (base != NULL) ? base + 1 : path;
+        size_t len = strlen(B->cfg->out_dir) + strlen(base) 
+                   + strlen(BATCH_OUT_EXT) + 2;
+        char *name = (char*)mem_alloc(len);
+        snprintf(name, len, "%s/%s" BATCH_OUT_EXT, B->cfg->out_dir, base);
+        if (fp != NULL && (dst = fopen(name, "w")) == NULL) {
+            fprintf(stderr, "cannot write %s\n", name);
+        }
+        mem_free(name);
+        if (dst != NULL) {
+            out = writer_create(dst);
+        }
+    } else {
+        out = writer_create(NULL);
+    }
+    if (fp != NULL && out != NULL) {
+        Reader_t *in = reader_create(fp);
+        run_puzzle(in, out, B->run);
+        reader_free(in);
+    } else {
+        pthread_mutex_lock(&B->lock);
+        B->failures++;
+        pthread_mutex_unlock(&B->lock);
+    }
+    if (fp != NULL) {
+        fclose(fp);
+    }
+    if (dst != NULL) {
+        writer_free(out);
+        fclose(dst);
+    } else if (B->cfg->out_dir == NULL) {
+        batch_emit(B, i, out);
+    }
+}
+
+// Hand in the output of input i, then write out every finished output
+// that no earlier one is still holding up, each under its file header
+void batch_emit(Batch_t *B, int i, Writer_t *out) {
+    pthread_mutex_lock(&B->lock);
+    B->done[i] = out;
+    while (B->emitted < B->n && B->done[B->emitted] != NULL) {
+        Writer_t *w = B->done[B->emitted];
+        fprintf(stdout, BATCH_DELIM, B->paths[B->emitted]);
+        fwrite(w->buf, 1, w->len, stdout);
+        mem_free(w->buf);
+        mem_free(w);
+        B->done[B->emitted++] = NULL;
+    }
+    pthread_mutex_unlock(&B->lock);
+}
+
+// Worker loop: claim inputs one at a time until none are left
+void* batch_worker(void *arg) {
+    Batch_t *B = (Batch_t*)arg;
+    int i;
+    while ((i = atomic_fetch_add(&B->next, 1)) < B->n) {
+        batch_run_one(B, i);
+    }
+    mem_pool_free();
+    return NULL;
+}
+
+// Run every input of the batch on a fixed set of worker threads
+int run_batch(BatchConfig_t *cfg, RunConfig_t *run) {
+    Batch_t B;
+    B.cfg = cfg;
+    B.run = run;
+    B.n = batch_list(cfg->path, &B.paths);
+    if (B.n < 0) {
+        fprintf(stderr, "cannot read %s\n", cfg->path);
+        return EXIT_FAILURE;
+    }
+    atomic_init(&B.next, 0);
+    B.done = (Writer_t**)mem_alloc(sizeof(Writer_t*) * (B.n > 0 ? B.n : 1));
+    memset(B.done, 0, sizeof(Writer_t*) * B.n);
+    B.emitted = 0;
+    B.failures = 0;
+    pthread_mutex_init(&B.lock, NULL);
+    int threads = (cfg->threads < B.n) ? cfg->threads : B.n;
+#ifdef HAVE_THREADS
+    pthread_t tid[MAX_THREADS];
+    for (int t = 1; t < threads; t++) {
+        pthread_create(&tid[t], NULL, batch_worker, &B);
+    }
+    batch_worker(&B);
+    for (int t = 1; t < threads; t++) {
+        pthread_join(tid[t], NULL);
+    }
+#else
+    (void)threads;
+    batch_worker(&B);
+#endif
+    fflush(stdout);
+    pthread_mutex_destroy(&B.lock);
+    for (int i = 0; i < B.n; i++) {
+        mem_free(B.paths[i]);
+    }
+    mem_free(B.paths);
+    mem_free(B.done);
+    return (B.failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Sequence search -----------------------------------------------------------*/
+
+// Read the search settings: --search turns it on, --search-depth=N bounds
+// the sequence length, --search-threads=N sets the worker count (all
+// cores by default) and --search-memory=MB bounds the stored states
+void search_config(int argc, char *argv[], SearchConfig_t *cfg) {
+    cfg->enabled = 0;
+    cfg->max_depth = SEARCH_DEPTH;
+    cfg->threads = 1;
+    cfg->budget = (long)SEARCH_MEMORY_MB << 20;
+#ifdef HAVE_THREADS
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    cfg->threads = (cores > 0) ? (int)cores : 1;
+#endif
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--search") == 0) {
+            cfg->enabled = 1;
+        } else if (strncmp(argv[i], "--search-depth=", 15) == 0) {
+            cfg->max_depth = atoi(argv[i] + 15);
+        } else if (strncmp(argv[i], "--search-threads=", 17) == 0) {
+            cfg->threads = atoi(argv[i] + 17);
+        } else if (strncmp(argv[i], "--search-memory=", 16) == 0) {
+            cfg->budget = atol(argv[i] + 16) << 20;
+        }
+    }
+    if (cfg->threads < 1) cfg->threads = 1;
+    if (cfg->threads > MAX_THREADS) cfg->threads = MAX_THREADS;
+}
+
+// Record the canonical state of matrix M as a new search node: its stored
+// cells in row-major order, stored zeros included as they still react to
+// a later add, and its hash. Returns NULL once the memory budget is used up.
+SearchNode_t* search_node(Search_t *S, CSRMatrix_t *M) {
+    csr_matrix_apply(M);
+    csr_matrix_materialize(M);
+    csr_matrix_pack(M);
+    long size = sizeof(SearchNode_t) + sizeof(int) * 3L * M->nnz;
+    if (atomic_fetch_add(&S->bytes, size) + size > S->budget) {
+        atomic_fetch_sub(&S->bytes, size);
+        S->stop = 1;
+        return NULL;
+    }
+    SearchNode_t *node = (SearchNode_t*)mem_alloc(size);
+    node->parent = NULL;
+    node->depth = 0;
+    node->key = 0;
+    node->op = 0;
+    memset(node->arg, 0, sizeof(node->arg));
+    node->nnz = M->nnz;
+    node->nz = 0;
+    node->hash = csr_matrix_hash(M);
+    int n = 0;
+    for (int k = 0; k < M->nrs; k++) {
+        for (int i = M->rptr[k]; i < M->rptr[k + 1]; i++) {
+            node->cells[n++] = slot_row(M, k);
+            node->cells[n++] = M->cidx[i];
+            node->cells[n++] = entry_value(M, i);
+            node->nz += (entry_value(M, i) != 0);
+        }
+    }
+    return node;
+}
+
+// Rebuild node's matrix, stored zeros included, using the worker's buffers
+CSRMatrix_t* search_matrix(Search_t *S, SearchNode_t *node) {
+    CSRMatrix_t *A = csr_matrix_create(S->rows, S->cols);
+    if (node->nnz == 0) {
+        return A;
+    }
+    csr_matrix_to_csr(A);
+    for (int i = 0; i < node->nnz; i++) {
+        value_bound(A, node->cells[3 * i + 2]);
+    }
+    int cap = node->nnz, w = val_width(A->vlo, A->vhi);
+    storage_swap(A, storage_alloc(&cap, w), cap, w);
+    for (int i = 0; i < node->nnz; i++) {
+        A->cidx[i] = node->cells[3 * i + 1];
+        entry_store(A, i, node->cells[3 * i + 2]);
+        A->rptr[node->cells[3 * i] + 1]++;
+    }
+    for (int r = 0; r < S->rows; r++) {
+        A->rptr[r + 1] += A->rptr[r];
+    }
+    A->nnz = node->nnz;
+    A->zeros = (node->nz != node->nnz);
+    A->hashed = 0;
+    csr_matrix_pick_layout(A);
+    return A;
+}
+
+// Free a search node and return its memory to the budget
+void search_free_node(Search_t *S, SearchNode_t *node) {
+    atomic_fetch_sub(&S->bytes, 
+                     sizeof(SearchNode_t) + sizeof(int) * 3L * node->nnz);
+    mem_free(node);
+}
+
+// Check if two search nodes hold the same state. Stored zeros make a matrix
+// differ from a target read from input, as in csr_matrix_equals.
+int search_same(SearchNode_t *a, SearchNode_t *b) {
+    return a->hash == b->hash && a->nnz == b->nnz 
+        && memcmp(a->cells, b->cells, sizeof(int) * 3 * a->nnz) == 0;
+}
+
+// Add node to the visited set unless its state is already there. A state
+// reached again within the same level keeps the smallest key, so the
+// sequence found does not depend on thread timing. Returns 1 if added.
+int search_insert(Search_t *S, SearchNode_t *node) {
+    SearchStripe_t *st = &S->stripes[node->hash & (SEARCH_STRIPES - 1)];
+    pthread_mutex_lock(&st->lock);
+    if (2 * (st->used + 1) > st->size) {
+        // Rehash into a table twice the size
+        long size = (st->size > 0) ? st->size * 2 : SEARCH_STRIPE_SLOTS;
+        atomic_fetch_add(&S->bytes, sizeof(SearchNode_t*) * (size - st->size));
+        SearchNode_t **slots = (SearchNode_t**)mem_alloc(
+            sizeof(SearchNode_t*) * size);
+        memset(slots, 0, sizeof(SearchNode_t*) * size);
+        for (long i = 0; i < st->size; i++) {
+            if (st->slots[i] != NULL) {
+                long j = (long)(st->slots[i]->hash >> 16) & (size - 1);
+                while (slots[j] != NULL) j = (j + 1) & (size - 1);
+                slots[j] = st->slots[i];
+            }
+        }
+        mem_free(st->slots);
+        st->slots = slots;
+        st->size = size;
+    }
+    long j = (long)(node->hash >> 16) & (st->size - 1);
+    while (st->slots[j] != NULL) {
+        SearchNode_t *old = st->slots[j];
+        if (search_same(old, node)) {
+            if (old->depth == node->depth && node->key < old->key) {
+                old->parent = node->parent;
+                old->key = node->key;
+                old->op = node->op;
+                memcpy(old->arg, node->arg, sizeof(node->arg));
+            }
+            pthread_mutex_unlock(&st->lock);
+            return 0;
+        }
+        j = (j + 1) & (st->size - 1);
+    }
+    st->slots[j] = node;
+    st->used++;
+    pthread_mutex_unlock(&st->lock);
+    return 1;
+}
+
+// Lower bound on the steps from node to the target. Each instruction
+// stores at most two rows or two columns of cells that are absent, so the
+// count of target cells still absent bounds the steps from below. Cells
+// stored as zero do not count: one a: makes all of them non-zero at once,
+// and m:0 stores zeros over the whole matrix. (The difference in non-zero
+// counts is no bound for the same reason, and as r: and c: can change it
+// by a whole row or column in one step.)
+int search_bound(Search_t *S, SearchNode_t *node) {
+    SearchNode_t *t = S->target;
+    int missing = 0, i = 0;
+    for (int j = 0; j < t->nnz; j++) {
+        while (i < node->nnz && (node->cells[3 * i] < t->cells[3 * j] 
+                || (node->cells[3 * i] == t->cells[3 * j] 
+                    && node->cells[3 * i + 1] < t->cells[3 * j + 1]))) {
+            i++;
+        }
+        missing += !(i < node->nnz && node->cells[3 * i] == t->cells[3 * j]
+                     && node->cells[3 * i + 1] == t->cells[3 * j + 1]);
+    }
+    int fill = 2 * (S->rows > S->cols ? S->rows : S->cols);
+    int bound = (missing + fill - 1) / fill;
+    return (bound > 1) ? bound : 1;
+}
+
+// Append an action to the worker's candidate list
+void search_push_action(SearchWorker_t *w, char op, int a0, int a1, 
+                        int a2, int a3) {
+    if (w->nacts >= w->acap) {
+        w->acap = (w->acap == 0) ? 64 : w->acap * GROWTH_FACTOR;
+        w->acts = (Instr_t*)mem_realloc(w->acts, sizeof(Instr_t) * w->acap);
+    }
+    Instr_t *a = &w->acts[w->nacts++];
+    a->op = op;
+    a->arg[0] = a0;
+    a->arg[1] = a1;
+    a->arg[2] = a2;
+    a->arg[3] = a3;
+}
+
+// Sort and deduplicate n values in place, returning the new count
+int unique_values(int *v, int n) {
+    qsort(v, n, sizeof(int), compare_ints);
+    int m = 0;
+    for (int i = 0; i < n; i++) {
+        if (m == 0 || v[m - 1] != v[i]) v[m++] = v[i];
+    }
+    return m;
+}
+
+// List the candidate instructions from dense state D. Values for s:, m:
+// and a: are limited to those that can produce a target value: s: writes
+// a differing cell's target value, S: moves a value to a cell that needs
+// it, and m: and a: map some current value onto some target value. Row
+// and column instructions are tried for every pair that changes anything.
+// Stored zeros become the added value, so with any stored a: also tries
+// every target value, and 0 to drop them.
+void search_actions(Search_t *S, SearchWorker_t *w, int *D, int zeros) {
+    int rows = S->rows, cols = S->cols, *T = S->dense;
+    w->nacts = 0;
+    for (int x = 0; x < rows * cols; x++) {
+        if (D[x] != T[x]) {
+            search_push_action(w, 's', x / cols, x % cols, T[x], 0);
+        }
+    }
+    for (int x = 0; x < rows * cols; x++) {
+        if (D[x] == T[x] || T[x] == 0) continue;
+        for (int y = 0; y < rows * cols; y++) {
+            if (y != x && D[y] == T[x]) {
+                search_push_action(w, 'S', x / cols, x % cols, 
+                                   y / cols, y % cols);
+            }
+        }
     }
     
-    // Copy from source row
-    for (int c = 0; c < A->cols; c++) {
-        int val = csr_matrix_get(A, r1, c);
-        if (val != 0) {
-            csr_matrix_set(A, r2, c, val);
+    // Distinct non-zero values now and in the target
+    int *now = w->vals, *want = w->vals + rows * cols, nn = 0, nw = 0;
+    for (int x = 0; x < rows * cols; x++) {
+        if (D[x] != 0) now[nn++] = D[x];
+        if (T[x] != 0) want[nw++] = T[x];
+    }
+    nn = unique_values(now, nn);
+    nw = unique_values(want, nw);
+    if (w->kcap < 2 + nn * (nw + 1) + nw) {
+        w->kcap = 2 + nn * (nw + 1) + nw;
+        w->ks = (int*)mem_realloc(w->ks, sizeof(int) * w->kcap);
+    }
+    int *ks = w->ks, nk = 0;
+    if (nn > 0) ks[nk++] = 0;
+    for (int i = 0; i < nn; i++) {
+        for (int j = 0; j < nw; j++) {
+            if (want[j] % now[i] == 0 && !(now[i] == -1 && want[j] == INT_MIN)
+                    && want[j] / now[i] != 1) {
+                ks[nk++] = want[j] / now[i];
+            }
+        }
+    }
+    nk = unique_values(ks, nk);
+    for (int i = 0; i < nk; i++) {
+        search_push_action(w, 'm', ks[i], 0, 0, 0);
+    }
+    nk = 0;
+    if (zeros) {
+        ks[nk++] = 0;
+        for (int j = 0; j < nw; j++) {
+            ks[nk++] = want[j];
+        }
+    }
+    for (int i = 0; i < nn; i++) {
+        ks[nk++] = (int)(0u - (unsigned)now[i]);
+        for (int j = 0; j < nw; j++) {
+            if (want[j] != now[i]) {
+                ks[nk++] = (int)((unsigned)want[j] - (unsigned)now[i]);
+            }
+        }
+    }
+    nk = unique_values(ks, nk);
+    for (int i = 0; i < nk; i++) {
+        search_push_action(w, 'a', ks[i], 0, 0, 0);
+    }
+    
+    // Copies (a row or column copied onto itself clears it) and swaps
+    for (int r1 = 0; r1 < rows; r1++) {
+        for (int r2 = 0; r2 < rows; r2++) {
+            int same = 1, empty = 1;
+            for (int c = 0; c < cols; c++) {
+                same &= (D[r1 * cols + c] == D[r2 * cols + c]);
+                empty &= (D[r2 * cols + c] == 0);
+            }
+            if ((r1 == r2) ? !empty : !same) {
+                search_push_action(w, 'r', r1, r2, 0, 0);
+                if (r1 < r2) search_push_action(w, 'R', r1, r2, 0, 0);
+            }
+        }
+    }
+    for (int c1 = 0; c1 < cols; c1++) {
+        for (int c2 = 0; c2 < cols; c2++) {
+            int same = 1, empty = 1;
+            for (int r = 0; r < rows; r++) {
+                same &= (D[r * cols + c1] == D[r * cols + c2]);
+                empty &= (D[r * cols + c2] == 0);
+            }
+            if ((c1 == c2) ? !empty : !same) {
+                search_push_action(w, 'c', c1, c2, 0, 0);
+                if (c1 < c2) search_push_action(w, 'C', c1, c2, 0, 0);
+            }
         }
     }
 }
 
-void op_copy_col(CSRMatrix_t *A, int c1, int c2) {
-    // Clear destination column
-    for (int r = 0; r < A->rows; r++) {
-        csr_matrix_set(A, r, c2, 0);
+// Expand node, the index-th state of the current level: apply every
+// candidate instruction to it and keep the children not seen before
+void search_expand(Search_t *S, SearchWorker_t *w, SearchNode_t *node, 
+                   long index) {
+    int rows = S->rows, cols = S->cols;
+    memset(w->dense, 0, sizeof(int) * rows * cols);
+    for (int i = 0; i < node->nnz; i++) {
+        int *cell = &node->cells[3 * i];
+        w->dense[cell[0] * cols + cell[1]] = cell[2];
     }
+    CSRMatrix_t *base = search_matrix(S, node);
+    search_actions(S, w, w->dense, node->nz != node->nnz);
     
-    // Copy from source column
-    for (int r = 0; r < A->rows; r++) {
-        int val = csr_matrix_get(A, r, c1);
-        if (val != 0) {
-            csr_matrix_set(A, r, c2, val);
+    for (int j = 0; j < w->nacts && !S->stop; j++) {
+        Instr_t *a = &w->acts[j];
+        CSRMatrix_t *M = csr_matrix_copy(base);
+        OPS[(unsigned char)a->op].run(M, a->arg);
+        SearchNode_t *child = search_node(S, M);
+        csr_matrix_free(M);
+        if (child == NULL) {
+            break;
+        }
+        child->parent = node;
+        child->depth = node->depth + 1;
+        child->key = ((unsigned long long)index << 32) | (unsigned)j;
+        child->op = a->op;
+        memcpy(child->arg, a->arg, sizeof(a->arg));
+        
+        if (search_same(child, S->target)) {
+            // Keep the goal with the smallest key
+            pthread_mutex_lock(&S->goal_lock);
+            if (S->goal == NULL || child->key < S->goal->key) {
+                if (S->goal != NULL) search_free_node(S, S->goal);
+                S->goal = child;
+                child = NULL;
+            }
+            pthread_mutex_unlock(&S->goal_lock);
+            if (child != NULL) search_free_node(S, child);
+        } else if (child->depth + search_bound(S, child) > S->max_depth 
+                   || !search_insert(S, child)) {
+            search_free_node(S, child);
+        } else {
+            if (w->nout >= w->ocap) {
+                w->ocap = (w->ocap == 0) ? 64 : w->ocap * GROWTH_FACTOR;
+                w->out = (SearchNode_t**)mem_realloc(w->out, 
+                                            sizeof(SearchNode_t*) * w->ocap);
+            }
+            w->out[w->nout++] = child;
         }
     }
+    csr_matrix_free(base);
 }
 
-void op_swap_row(CSRMatrix_t *A, int r1, int r2) {
-    if (r1 == r2) return;
+// Worker loop: claim chunks of the current level until none are left
+void* search_worker(void *arg) {
+    SearchWorker_t *w = (SearchWorker_t*)arg;
+    Search_t *S = w->S;
+    for (;;) {
+        long lo = atomic_fetch_add(&S->next, SEARCH_CHUNK);
+        if (lo >= S->nfront || S->stop) {
+            break;
+        }
+        long hi = (lo + SEARCH_CHUNK < S->nfront) ? lo + SEARCH_CHUNK 
+                                                  : S->nfront;
+        for (long i = lo; i < hi && !S->stop; i++) {
+            search_expand(S, w, S->frontier[i], i);
+        }
+    }
+    // Pooled memory is per thread
+    if (w->id > 0) {
+        mem_pool_free();
+    }
+    return NULL;
+}
+
+// Compare search nodes by key, for qsort
+int compare_node_keys(const void *a, const void *b) {
+    unsigned long long x = (*(SearchNode_t* const*)a)->key;
+    unsigned long long y = (*(SearchNode_t* const*)b)->key;
+    return (x > y) - (x < y);
+}
+
+// Compare two ints, for qsort
+int compare_ints(const void *a, const void *b) {
+    int x = *(const int*)a, y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+
+// Find a shortest instruction sequence from initial to target by
+// breadth-first search, one level at a time. Worker threads claim chunks
+// of the level through a shared counter, and states are deduplicated in a
+// visited set split into separately locked stripes by hash. Prints the
+// sequence, one instruction per line, in the input format.
+void search_and_print(Writer_t *out, CSRMatrix_t *initial, 
+                      CSRMatrix_t *target, SearchConfig_t *cfg) {
+    if ((long)initial->rows * initial->cols > SEARCH_MAX_CELLS) {
+        fprintf(stderr, "search needs at most %d cells\n", SEARCH_MAX_CELLS);
+        exit(EXIT_FAILURE);
+    }
+    Search_t *S = (Search_t*)mem_alloc(sizeof(Search_t));
+    int rows = S->rows = initial->rows, cols = S->cols = initial->cols;
+    S->budget = cfg->budget;
+    S->max_depth = cfg->max_depth;
+    S->goal = NULL;
+    S->stop = 0;
+    atomic_init(&S->bytes, 0);
+    atomic_init(&S->next, 0);
+    pthread_mutex_init(&S->goal_lock, NULL);
+    for (int i = 0; i < SEARCH_STRIPES; i++) {
+        pthread_mutex_init(&S->stripes[i].lock, NULL);
+        S->stripes[i].slots = NULL;
+        S->stripes[i].size = S->stripes[i].used = 0;
+    }
+    CSRMatrix_t *M = csr_matrix_copy(target);
+    S->target = search_node(S, M);
+    csr_matrix_free(M);
+    M = csr_matrix_copy(initial);
+    SearchNode_t *root = search_node(S, M);
+    csr_matrix_free(M);
+    assert(S->target != NULL && root != NULL);
+    S->dense = (int*)mem_alloc(sizeof(int) * rows * cols);
+    memset(S->dense, 0, sizeof(int) * rows * cols);
+    for (int i = 0; i < S->target->nnz; i++) {
+        int *cell = &S->target->cells[3 * i];
+        S->dense[cell[0] * cols + cell[1]] = cell[2];
+    }
     
-    // Create temporary copies of both rows
-    CSRMatrix_t *temp = csr_matrix_create(1, A->cols);
-    for (int c = 0; c < A->cols; c++) {
-        csr_matrix_set(temp, 0, c, csr_matrix_get(A, r1, c));
+    SearchWorker_t workers[MAX_THREADS];
+    for (int t = 0; t < cfg->threads; t++) {
+        SearchWorker_t *w = &workers[t];
+        memset(w, 0, sizeof(SearchWorker_t));
+        w->S = S;
+        w->id = t;
+        w->dense = (int*)mem_alloc(sizeof(int) * rows * cols);
+        w->vals = (int*)mem_alloc(sizeof(int) * 2 * rows * cols);
+    }
+    
+    // Expand level by level until a goal turns up or nothing is left
+    long states = 1;
+    int depth = 0;
+    S->frontier = (SearchNode_t**)mem_alloc(sizeof(SearchNode_t*));
+    S->frontier[0] = root;
+    S->nfront = 1;
+    search_insert(S, root);
+    if (search_same(root, S->target)) {
+        S->goal = root;
+    }
+    while (S->goal == NULL && S->nfront > 0 && !S->stop 
+           && depth < S->max_depth) {
+        atomic_store(&S->next, 0);
+#ifdef HAVE_THREADS
+        pthread_t tid[MAX_THREADS];
+        for (int t = 1; t < cfg->threads; t++) {
+            pthread_create(&tid[t], NULL, search_worker, &workers[t]);
+        }
+        search_worker(&workers[0]);
+        for (int t = 1; t < cfg->threads; t++) {
+            pthread_join(tid[t], NULL);
+        }
+#else
+        search_worker(&workers[0]);
+#endif
+        // The next level, in key order
+        long n = 0;
+        for (int t = 0; t < cfg->threads; t++) {
+            n += workers[t].nout;
+        }
+        S->frontier = (SearchNode_t**)mem_realloc(S->frontier, 
+                                    sizeof(SearchNode_t*) * (n > 0 ? n : 1));
+        S->nfront = 0;
+        for (int t = 0; t < cfg->threads; t++) {
+            if (workers[t].nout > 0) {
+                memcpy(S->frontier + S->nfront, workers[t].out, 
+                       sizeof(SearchNode_t*) * workers[t].nout);
+            }
+            S->nfront += workers[t].nout;
+            workers[t].nout = 0;
+        }
+        qsort(S->frontier, S->nfront, sizeof(SearchNode_t*), 
+              compare_node_keys);
+        states += S->nfront;
+        depth++;
     }
     
-    // Copy row r2 to row r1
-    op_copy_row(A, r2, r1);
+    // Report, walking back from the goal for the sequence
+    write_str(out, SEARCH_DELIM);
+    write_fmt(out, "States explored: %ld\n", states);
+    if (S->goal != NULL) {
+        int steps = S->goal->depth;
+        write_fmt(out, "Shortest sequence: %d step(s)\n", steps);
+        SearchNode_t **path = (SearchNode_t**)mem_alloc(
+            sizeof(SearchNode_t*) * (steps > 0 ? steps : 1));
+        int n = 0;
+        for (SearchNode_t *v = S->goal; v->parent != NULL; v = v->parent) {
+            path[n++] = v;
+        }
+        for (int i = n - 1; i >= 0; i--) {
+            write_fmt(out, "%c:", path[i]->op);
+            for (int j = 0; j < OPS[(unsigned char)path[i]->op].nargs; j++) {
+                write_fmt(out, (j > 0) ? ",%d" : "%d", path[i]->arg[j]);
+            }
+            write_str(out, "\n");
+        }
+        mem_free(path);
+    } else if (S->stop) {
+        write_fmt(out, "Memory budget of %ld MiB used up at depth %d\n", 
+                  S->budget >> 20, depth + 1);
+    } else {
+        write_fmt(out, "No sequence within %d step(s)\n", S->max_depth);
+    }
+    write_str(out, THEEND);
     
-    // Copy temporary row to row r2
-    for (int c = 0; c < A->cols; c++) {
-        csr_matrix_set(A, r2, c, csr_matrix_get(temp, 0, c));
+    // Every stored state is in the visited set, except a goal
+    if (S->goal != NULL && S->goal != root) {
+        search_free_node(S, S->goal);
     }
+    for (int i = 0; i < SEARCH_STRIPES; i++) {
+        for (long j = 0; j < S->stripes[i].size; j++) {
+            if (S->stripes[i].slots[j] != NULL) {
+                search_free_node(S, S->stripes[i].slots[j]);
+            }
+        }
+        mem_free(S->stripes[i].slots);
+        pthread_mutex_destroy(&S->stripes[i].lock);
+    }
+    for (int t = 0; t < cfg->threads; t++) {
+        mem_free(workers[t].dense);
+        mem_free(workers[t].vals);
+        mem_free(workers[t].ks);
+        mem_free(workers[t].acts);
+        mem_free(workers[t].out);
+    }
+    pthread_mutex_destroy(&S->goal_lock);
+    search_free_node(S, S->target);
+    mem_free(S->frontier);
+    mem_free(S->dense);
+    mem_free(S);
+}
+
+/* Workloads and benchmarks --------------------------------------------------*/
+
+// Read workload settings from spec, "key=value" pairs separated by commas,
+// over GEN_DEFAULTS. Keys are rows, cols, nnz, skew, vals, instrs, seed and
+// mix, whose value is opcodes each followed by its weight, as in
+// "mix=s8S2m1". Returns 0 for an unknown key or a bad value.
+int gen_parse(const char *spec, GenConfig_t *g) {
+    static const char *keys[] = {
+        "rows", "cols", "nnz", "skew", "vals", "instrs", "seed", "mix"
+    };
+    const char *specs[2] = {GEN_DEFAULTS, spec};
+    for (int s = 0; s < 2; s++) {
+        const char *p = specs[s];
+        while (*p != '\0') {
+            const char *end = strchr(p, ',');
+            if (end == NULL) end = p + strlen(p);
+            const char *eq = memchr(p, '=', end - p);
+            if (eq == NULL) {
+                return 0;
+            }
+            int key = 0;
+            while (key < 8 && ((size_t)(eq - p) != strlen(keys[key]) 
+                               || strncmp(p, keys[key], eq - p) != 0)) {
+                key++;
+            }
+            char *stop;
+            long long v = 0;
+            if (key < 7) {
+                v = strtoll(eq + 1, &stop, 10);
+                if (stop != end || v < 0 || (key != 6 && v > INT_MAX)) {
+                    return 0;
+                }
+            }
+            switch (key) {
+                case 0: g->rows = (int)v; break;
+                case 1: g->cols = (int)v; break;
+                case 2: g->nnz = (long)v; break;
+                case 3: g->skew = (int)v; break;
+                case 4: g->vmax = (int)v; break;
+                case 5: g->instrs = (long)v; break;
+                case 6: g->seed = (unsigned long long)v; break;
+                case 7:
+                    memset(g->mix, 0, sizeof(g->mix));
+                    for (const char *q = eq + 1; q < end; q = stop) {
+                        const char *op = strchr(OPCODES, *q);
+                        if (*q == '\0' || op == NULL) {
+                            return 0;
+                        }
+                        long w = strtol(q + 1, &stop, 10);
+                        if (stop == q + 1 || stop > end || w < 0 
+                                || w > INT_MAX / NUM_OPCODES) {
+                            return 0;
+                        }
+                        g->mix[op - OPCODES] = (int)w;
+                    }
+                    break;
+                default: return 0;
+            }
+            p = (*end != '\0') ? end + 1 : end;
+        }
+    }
+    int weight = 0;
+    for (int k = 0; k < NUM_OPCODES; k++) {
+        weight += g->mix[k];
+    }
+    return g->rows > 0 && g->cols > 0 && g->vmax > 0 
+        && (weight > 0 || g->instrs == 0);
+}
+
+// Next number of the splitmix64 sequence kept in *state
+unsigned long long gen_rand(unsigned long long *state) {
+    unsigned long long z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Random number in 0..n-1
+long gen_below(unsigned long long *state, long n) {
+    return (long)(gen_rand(state) % (unsigned long long)n);
+}
+
+// Write the cells of one random matrix, row by row. Rows are ranked in a
+// random order and the row of rank k gets a share of the cells in
+// proportion to 1/k^skew; a row's cells are spread over its columns.
+void gen_matrix(Writer_t *out, GenConfig_t *g, unsigned long long *state) {
+    int *order = (int*)mem_alloc(sizeof(int) * g->rows);
+    int *len = (int*)mem_alloc(sizeof(int) * g->rows);
+    for (int r = 0; r < g->rows; r++) {
+        order[r] = r;
+    }
+    for (int r = g->rows - 1; r > 0; r--) {
+        int j = (int)gen_below(state, r + 1);
+        int t = order[r];
+        order[r] = order[j];
+        order[j] = t;
+    }
+    double total = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int k = 0; k < g->rows; k++) {
+            double w = 1.0;
+            for (int s = 0; s < g->skew; s++) {
+                w /= k + 1;
+            }
+            if (pass == 0) {
+                total += w;
+                continue;
+            }
+            // Round the expected length up or down at random, keeping nnz
+            // right on average
+            double want = (double)g->nnz * w / total;
+            double frac = want - (long)want;
+            long n = (long)want 
+                   + ((double)(gen_rand(state) >> 11) / 9007199254740992.0 
+                      < frac);
+            len[order[k]] = (n < g->cols) ? (int)n : g->cols;
+        }
+    }
+    for (int r = 0; r < g->rows; r++) {
+        // Column i falls in the i-th of len[r] equal spans, so the columns
+        // are distinct and ascending
+        double span = (double)g->cols / (len[r] > 0 ? len[r] : 1);
+        for (int i = 0; i < len[r]; i++) {
+            int c = (int)(i * span) + (int)gen_below(state, (long)span);
+            write_int(out, r);
+            write_bytes(out, ",", 1);
+            write_int(out, c);
+            write_bytes(out, ",", 1);
+            write_int(out, 1 + (int)gen_below(state, g->vmax));
+            write_bytes(out, "\n", 1);
+        }
+    }
+    mem_free(order);
+    mem_free(len);
+}
+
+// Write a whole input for g: dimensions, the initial and target matrices
+// and the instructions, drawn in proportion to the opcode mix
+void gen_input(Writer_t *out, GenConfig_t *g) {
+    unsigned long long state = g->seed;
+    write_fmt(out, MTXDIM, g->rows, g->cols);
+    gen_matrix(out, g, &state);
+    write_str(out, "#\n");
+    gen_matrix(out, g, &state);
+    write_str(out, "#\n");
+    int weight = 0;
+    for (int k = 0; k < NUM_OPCODES; k++) {
+        weight += g->mix[k];
+    }
+    for (long i = 0; i < g->instrs; i++) {
+        int pick = (int)gen_below(&state, weight), k = 0;
+        while (pick >= g->mix[k]) {
+            pick -= g->mix[k++];
+        }
+        int arg[MAX_OP_ARGS], n = 2;
+        arg[0] = (int)gen_below(&state, g->rows);
+        arg[1] = (int)gen_below(&state, g->cols);
+        switch (OPCODES[k]) {
+            case 's':
+                // Values of 0 delete cells
+                arg[2] = (int)gen_below(&state, g->vmax + 1);
+                n = 3;
+                break;
+            case 'S':
+                arg[2] = (int)gen_below(&state, g->rows);
+                arg[3] = (int)gen_below(&state, g->cols);
+                n = 4;
+                break;
+            case 'm':
+                arg[0] = 2 + (int)gen_below(&state, 2);
+                n = 1;
+                break;
+            case 'a':
+                arg[0] = 1 + (int)gen_below(&state, g->vmax);
+                if (gen_below(&state, 2)) arg[0] = -arg[0];
+                n = 1;
+                break;
+            case 'r':
+            case 'R':
+                arg[1] = (int)gen_below(&state, g->rows);
+                break;
+            default:
+                arg[0] = (int)gen_below(&state, g->cols);
+                arg[1] = (int)gen_below(&state, g->cols);
+                break;
+        }
+        write_bytes(out, &OPCODES[k], 1);
+        write_bytes(out, ":", 1);
+        for (int j = 0; j < n; j++) {
+            if (j > 0) write_bytes(out, ",", 1);
+            write_int(out, arg[j]);
+        }
+        write_bytes(out, "\n", 1);
+    }
+}
+
+// Write the input described by workload spec to out
+int run_generate(Writer_t *out, const char *spec) {
+    GenConfig_t g;
+    if (!gen_parse(spec, &g)) {
+        fprintf(stderr, "bad workload %s\n", spec);
+        return EXIT_FAILURE;
+    }
+    gen_input(out, &g);
+    return EXIT_SUCCESS;
+}
+
+// Read the benchmark settings: --bench times the BENCH_SCALES workloads,
+// --bench=SPEC;SPEC;... times the given ones instead, and each
+// --bench-check=INPUT:EXPECTED runs INPUT and compares its output with the
+// file EXPECTED
+void bench_config(int argc, char *argv[], BenchConfig_t *cfg) {
+    cfg->scales = NULL;
+    cfg->checks = NULL;
+    cfg->nchecks = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--bench") == 0) {
+            cfg->scales = BENCH_SCALES;
+        } else if (strncmp(argv[i], "--bench=", 8) == 0) {
+            cfg->scales = argv[i] + 8;
+        } else if (strncmp(argv[i], "--bench-check=", 14) == 0) {
+            cfg->checks = (char**)mem_realloc(cfg->checks, 
+                                    sizeof(char*) * (cfg->nchecks + 1));
+            cfg->checks[cfg->nchecks++] = argv[i] + 14;
+        }
+    }
+}
+
+// Wall-clock time in seconds; phases may run on several threads, so CPU
+// time would overstate them
+double bench_now(void) {
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+// Write one result row: phase handled count items in secs; A gives the
+// workload's dimensions and nnz, or is NULL for a cross-check
+void bench_row(Writer_t *out, const char *workload, CSRMatrix_t *A, 
+               const char *phase, long count, double secs, 
+               const char *status) {
+    write_fmt(out, "\"%s\",", workload);
+    if (A != NULL) {
+        write_fmt(out, "%d,%d,%d,", A->rows, A->cols, A->nnz);
+    } else {
+        write_str(out, ",,,");
+    }
+    write_fmt(out, "%s,%ld,%.3f,%.1f,%s\n", phase, count, 1e3 * secs, 
+              (count > 0) ? 1e9 * secs / count : 0.0, status);
+}
+
+// Run the input of pair "INPUT:EXPECTED" and compare its output with the
+// expected file, ignoring trailing newlines; returns 1 if they match
+int bench_check(Writer_t *out, char *pair, RunConfig_t *run) {
+    char *sep = strrchr(pair, ':');
+    if (sep == NULL) {
+        fprintf(stderr, "bad check %s\n", pair);
+        return 0;
+    }
+    *sep = '\0';
+    FILE *fp = fopen(pair, "r");
+    FILE *ef = fopen(sep + 1, "rb");
+    if (fp == NULL || ef == NULL) {
+        fprintf(stderr, "cannot open %s\n", (fp == NULL) ? pair : sep + 1);
+        if (fp != NULL) fclose(fp);
+        if (ef != NULL) fclose(ef);
+        return 0;
+    }
+    Writer_t *got = writer_create(NULL);
+    double start = bench_now();
+    Reader_t *in = reader_create(fp);
+    run_puzzle(in, got, run);
+    reader_free(in);
+    double secs = bench_now() - start;
+    fclose(fp);
     
-    csr_matrix_free(temp);
+    Writer_t *want = writer_create(NULL);
+    size_t n;
+    do {
+        n = fread(writer_space(want, INPUT_BLOCK_SIZE), 1, INPUT_BLOCK_SIZE, 
+                  ef);
+        want->len += (int)n;
+    } while (n > 0);
+    fclose(ef);
+    while (got->len > 0 && got->buf[got->len - 1] == '\n') got->len--;
+    while (want->len > 0 && want->buf[want->len - 1] == '\n') want->len--;
+    int same = got->len == want->len 
+            && memcmp(got->buf, want->buf, got->len) == 0;
+    bench_row(out, pair, NULL, "check", got->len, secs, 
+              same ? "ok" : "mismatch");
+    *sep = ':';
+    writer_free(got);
+    writer_free(want);
+    return same;
 }
 
-void op_swap_col(CSRMatrix_t *A, int c1, int c2) {
-    if (c1 == c2) return;
+// Generate the workload spec describes into a temporary file, then time
+// loading it, each opcode, the per-step equality check and printing the
+// final matrix; returns 0 if the spec is bad or no file can be made
+int bench_workload(Writer_t *out, const char *spec, RunConfig_t *run) {
+    GenConfig_t g;
+    if (!gen_parse(spec, &g)) {
+        fprintf(stderr, "bad workload %s\n", spec);
+        return 0;
+    }
+    FILE *fp = tmpfile();
+    if (fp == NULL) {
+        fprintf(stderr, "cannot create a workload file\n");
+        return 0;
+    }
+    Writer_t *w = writer_create(fp);
+    gen_input(w, &g);
+    writer_free(w);
+    rewind(fp);
     
-    // Swap column indices in all rows
-    for (int r = 0; r < A->rows; r++) {
-        for (int i = A->rptr[r]; i < A->rptr[r + 1]; i++) {
-            if (A->cidx[i] == c1) {
-                A->cidx[i] = c2;
-            } else if (A->cidx[i] == c2) {
-                A->cidx[i] = c1;
-            }
+    Reader_t *in = reader_create(fp);
+    double start = bench_now();
+    int rows = 0, cols = 0;
+    read_dims(in, &rows, &cols);
+    CSRMatrix_t *initial = csr_matrix_read(in, rows, cols);
+    CSRMatrix_t *target = csr_matrix_read(in, rows, cols);
+    double load = bench_now() - start;
+    long loaded = (long)initial->nnz + target->nnz;
+    bench_row(out, spec, initial, "load", loaded, load, "ok");
+    
+    CSRMatrix_t *current = csr_matrix_copy(initial);
+    csr_matrix_reserve(current, target->nnz);
+    current->use_csc = (run->col_mode != COLINDEX_OFF);
+    if (run->col_mode == COLINDEX_EAGER) {
+        csr_matrix_index_cols(current);
+    }
+    double op_secs[NUM_OPCODES] = {0}, equal_secs = 0;
+    long op_count[NUM_OPCODES] = {0}, steps = 0;
+    char *line;
+    int len;
+    while ((line = reader_line(in, &len)) != NULL) {
+        if (len == 0) continue;
+        const OpEntry_t *op = &OPS[(unsigned char)line[0]];
+        if (op->run == NULL) {
+            break;
+        }
+        int arg[MAX_OP_ARGS] = {0, 0, 0, 0};
+        if (len > 2) {
+            scan_ints(line + 2, line + len, arg, MAX_OP_ARGS);
+        }
+        int k = (int)(strchr(OPCODES, line[0]) - OPCODES);
+        start = bench_now();
+        op->run(current, arg);
+        double mid = bench_now();
+        csr_matrix_equals(current, target);
+        equal_secs += bench_now() - mid;
+        op_secs[k] += mid - start;
+        op_count[k]++;
+        steps++;
+    }
+    for (int k = 0; k < NUM_OPCODES; k++) {
+        if (op_count[k] > 0) {
+            char phase[] = "op_?";
+            phase[3] = OPCODES[k];
+            bench_row(out, spec, initial, phase, op_count[k], op_secs[k], 
+                      "ok");
         }
     }
+    bench_row(out, spec, initial, "equals", steps, equal_secs, "ok");
+    
+    Writer_t *mem = writer_create(NULL);
+    start = bench_now();
+    csr_matrix_print(mem, current, "Current matrix");
+    double print = bench_now() - start;
+    bench_row(out, spec, initial, "print", current->nnz, print, "ok");
+    writer_free(mem);
+    
+    reader_free(in);
+    fclose(fp);
+    cleanup_matrices(initial, target, current);
+    return 1;
 }
 
-// Print solution message and cleanup matrices
-void print_solution_and_cleanup(CSRMatrix_t* initial, CSRMatrix_t* target, 
-                                CSRMatrix_t* current, int step_count) {
-    printf("%s\n", DELIMITER);
-    printf("TA-DAA!!! SOLVED IN %d STEP(S)!\n", step_count);
-    printf(THEEND);
-    csr_matrix_free(initial);
-    csr_matrix_free(target);
-    csr_matrix_free(current);
+// Cross-check reference outputs, then time each workload, writing one CSV
+// row per phase to stdout as it finishes
+int run_bench(BenchConfig_t *cfg, RunConfig_t *run) {
+    Writer_t *out = writer_create(stdout);
+    write_str(out, BENCH_HEADER);
+    int failures = 0;
+    for (int i = 0; i < cfg->nchecks; i++) {
+        failures += !bench_check(out, cfg->checks[i], run);
+        writer_flush(out);
+    }
+    const char *p = cfg->scales;
+    while (p != NULL && *p != '\0') {
+        const char *end = strchr(p, ';');
+        if (end == NULL) end = p + strlen(p);
+        char *spec = (char*)mem_alloc(end - p + 1);
+        memcpy(spec, p, end - p);
+        spec[end - p] = '\0';
+        failures += !bench_workload(out, spec, run);
+        writer_flush(out);
+        mem_free(spec);
+        p = (*end != '\0') ? end + 1 : end;
+    }
+    writer_free(out);
+    mem_free(cfg->checks);
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
-// Cleanup matrices without printing solution message
-void cleanup_matrices(CSRMatrix_t* initial, CSRMatrix_t* target, 
-                      CSRMatrix_t* current) {
-    csr_matrix_free(initial);
-    csr_matrix_free(target);
-    csr_matrix_free(current);
+/* Profiling -----------------------------------------------------------------*/
+
+// Read the profile settings: --profile reports to stderr and
+// --profile=PATH to a file, as JSON if PATH ends in ".json", else as
+// text; PROFILE_ENV gives the same choice, with 1 for stderr. Counters
+// exist only in builds with -DPROFILE.
+void profile_config(int argc, char *argv[]) {
+    int wanted = 0;
+    char *path = getenv(PROFILE_ENV);
+    if (path != NULL && path[0] != '\0') {
+        wanted = 1;
+        if (strcmp(path, "1") == 0) path = NULL;
+    } else {
+        path = NULL;
+    }
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--profile") == 0) {
+            wanted = 1;
+            path = NULL;
+        } else if (strncmp(argv[i], "--profile=", 10) == 0) {
+            wanted = 1;
+            path = argv[i] + 10;
+        }
+    }
+    if (!wanted) {
+        return;
+    }
+#ifdef PROFILE
+    size_t len = (path != NULL) ? strlen(path) : 0;
+    profile.path = path;
+    profile.json = len >= 5 && strcmp(path + len - 5, ".json") == 0;
+    profile.on = 1;
+    atexit(report_profile);
+#else
+    fprintf(stderr, "profiling needs a build with -DPROFILE\n");
+#endif
+}
+
+#ifdef PROFILE
+// Current time in PROF_UNIT
+unsigned long long prof_clock(void) {
+#ifdef HAVE_X86_SIMD
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+// Raise *max to at least v
+void prof_max(_Atomic long long *max, long long v) {
+    long long seen = atomic_load(max);
+    while (v > seen && !atomic_compare_exchange_weak(max, &seen, v)) {
+    }
+}
+
+// Enter site on this thread
+void prof_begin(int site) {
+    ProfStack_t *st = &prof_stack;
+    if (st->depth < PROF_DEPTH) {
+        st->site[st->depth] = site;
+        st->start[st->depth] = prof_clock();
+    }
+    st->depth++;
+}
+
+// Leave site, the innermost open on this thread, counting its time
+void prof_end(int site) {
+    ProfStack_t *st = &prof_stack;
+    assert(st->depth > 0);
+    if (--st->depth >= PROF_DEPTH) {
+        return;
+    }
+    assert(st->site[st->depth] == site);
+    long long ticks = (long long)(prof_clock() - st->start[st->depth]);
+    ProfCounters_t *c = &profile.site[site];
+    c->calls++;
+    c->ticks += ticks;
+    prof_max(&c->max, ticks);
+}
+
+// Count n entries moved in memory against every open site
+void prof_shift(long n) {
+    ProfStack_t *st = &prof_stack;
+    int depth = (st->depth < PROF_DEPTH) ? st->depth : PROF_DEPTH;
+    for (int i = 0; i < depth; i++) {
+        profile.site[st->site[i]].shifted += n;
+    }
+}
+
+// Count a block resize against every open site
+void prof_realloc(void) {
+    ProfStack_t *st = &prof_stack;
+    int depth = (st->depth < PROF_DEPTH) ? st->depth : PROF_DEPTH;
+    for (int i = 0; i < depth; i++) {
+        profile.site[st->site[i]].reallocs++;
+    }
+}
+
+// Track the peak nnz and storage capacity of A
+void prof_peak(CSRMatrix_t *A) {
+    int seen = atomic_load(&profile.peak_nnz);
+    while (A->nnz > seen 
+           && !atomic_compare_exchange_weak(&profile.peak_nnz, &seen, A->nnz)) {
+    }
+    seen = atomic_load(&profile.peak_cap);
+    while (A->cap > seen 
+           && !atomic_compare_exchange_weak(&profile.peak_cap, &seen, A->cap)) {
+    }
+}
+
+// Write the counters of every site that ran to the report destination
+void report_profile(void) {
+    static const char *routines[] = {
+        "parse", "read", "equals", "print", "hash", "apply", "materialize", 
+        "relayout", "pack", "spread", "copy", "index"
+    };
+    FILE *fp = stderr;
+    if (profile.path != NULL && (fp = fopen(profile.path, "w")) == NULL) {
+        fprintf(stderr, "cannot write %s\n", profile.path);
+        return;
+    }
+    if (profile.json) {
+        fprintf(fp, "{\"unit\": \"%s\", \"sites\": [", PROF_UNIT);
+    } else {
+        fprintf(fp, "%-12s %10s %14s %12s %12s %9s\n", "site", "calls", 
+                "total " PROF_UNIT, "max", "shifted", "reallocs");
+    }
+    int listed = 0;
+    for (int s = 0; s < PROF_SITES; s++) {
+        ProfCounters_t *c = &profile.site[s];
+        if (c->calls == 0) {
+            continue;
+        }
+        char name[16];
+        if (s < NUM_OPCODES) {
+            snprintf(name, sizeof(name), "op %c", OPCODES[s]);
+        } else {
+            snprintf(name, sizeof(name), "%s", routines[s - NUM_OPCODES]);
+        }
+        if (profile.json) {
+            fprintf(fp, "%s\n  {\"site\": \"%s\", \"calls\": %ld, "
+                    "\"total\": %lld, \"max\": %lld, \"shifted\": %lld, "
+                    "\"reallocs\": %ld}", listed ? "," : "", name, 
+                    (long)c->calls, (long long)c->ticks, (long long)c->max, 
+                    (long long)c->shifted, (long)c->reallocs);
+        } else {
+            fprintf(fp, "%-12s %10ld %14lld %12lld %12lld %9ld\n", name, 
+                    (long)c->calls, (long long)c->ticks, (long long)c->max, 
+                    (long long)c->shifted, (long)c->reallocs);
+        }
+        listed++;
+    }
+    if (profile.json) {
+        fprintf(fp, "\n], \"peak_nnz\": %d, \"peak_cap\": %d}\n", 
+                (int)profile.peak_nnz, (int)profile.peak_cap);
+    } else {
+        fprintf(fp, "peak nnz: %d, peak capacity: %d\n", 
+                (int)profile.peak_nnz, (int)profile.peak_cap);
+    }
+    if (fp != stderr) {
+        fclose(fp);
+    }
 }
+#endif
 
 //algorithms are fun！
 /* THE END -------------------------------------------------------------------*/
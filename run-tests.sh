@@ -0,0 +1,37 @@
+#!/bin/sh
+# Run each input below through the program with its flags and compare the
+# output, errors included, with the expected one. Run it from the top of
+# the tree, as inputs name their snapshot files relative to it (snapshots
+# are in native byte order, little-endian here). Build the program as C11,
+# e.g. gcc -std=c11 -O2 -pthread -o ass2-soln ass2-soln.c. Usage:
+# ./run-tests.sh [program]
+prog=${1:-./ass2-soln}
+fail=0
+
+check() {
+    input=$1 expected=$2
+    shift 2
+    if "$prog" "$@" < "$input" 2>&1 | cmp -s - "$expected"; then
+        echo "ok   $input${*:+ $*}"
+    else
+        echo "FAIL $input${*:+ $*}"
+        fail=1
+    fi
+}
+
+# m:0 then a:7 solves it; the search bound must not rule out depth 2
+check test4.txt compare4.txt --search --search-depth=2
+
+# A snapshot target equal to the initial matrix is solved at once; one
+# whose header hash was altered, that stores a zero its header rules out,
+# or that holds a matrix of other dimensions, is rejected
+check test5.txt compare5.txt
+check test6.txt compare6.txt
+check test7.txt compare7.txt
+check test8.txt compare8.txt
+
+# Values that outgrow int8_t and int16_t through s:, m: and a:, and fit
+# int8_t again after m:0, keep their full values throughout
+check test9.txt compare9.txt
+
+exit $fail